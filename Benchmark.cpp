@@ -0,0 +1,342 @@
+#include "ConsoleGameEngine.h"
+#include <random>
+
+//Measures throughput of the drawing primitives on a headless screen.
+//Usage: Benchmark [output.csv]
+class Benchmark : public ConsoleGameEngine
+{
+private:
+	struct Result
+	{
+		const wchar_t* name;
+		double cells;
+		double seconds;
+		int operations;
+	};
+
+	std::vector<Result> results;
+	std::mt19937 random;
+
+	static const int operations = 20000;
+
+public:
+	bool OnUpdate(float elapsedTime) override
+	{
+		return false;
+	}
+
+	void Run()
+	{
+		results.clear();
+		random.seed(1337);
+
+		int w = GetScreenWidth();
+		int h = GetScreenHeight();
+
+		std::vector<int> p(operations * 6);
+		for (int i = 0; i < operations * 6; i += 2)
+		{
+			p[i] = random() % w;
+			p[i + 1] = random() % h;
+		}
+
+		Measure(L"DrawLine", [&](int i)
+		{
+			int *v = &p[i * 6];
+			DrawLine(v[0], v[1], v[2], v[3], PIXEL_SOLID, (short)i);
+			return (double)(max(abs(v[2] - v[0]), abs(v[3] - v[1])) + 1);
+		});
+
+		Measure(L"DrawFilledRectangle", [&](int i)
+		{
+			int *v = &p[i * 6];
+			DrawFilledRectangle(v[0], v[1], v[2], v[3], PIXEL_SOLID, (short)i);
+			return (double)((abs(v[2] - v[0]) + 1) * (abs(v[3] - v[1]) + 1));
+		});
+
+		Measure(L"DrawFilledTriangle", [&](int i)
+		{
+			int *v = &p[i * 6];
+			DrawFilledTriangle(v[0], v[1], v[2], v[3], v[4], v[5], PIXEL_SOLID, (short)i);
+			return abs((double)(v[2] - v[0]) * (v[5] - v[1]) - (double)(v[4] - v[0]) * (v[3] - v[1])) / 2.0;
+		});
+
+		//A grid of 16x16 quads covering the screen, two triangles each
+		std::vector<MeshVertex> vertices;
+		std::vector<int> indices;
+		for (int y = 0; y <= 16; y++)
+		{
+			for (int x = 0; x <= 16; x++)
+				vertices.push_back({ (float)(x * w) / 16.0f, (float)(y * h) / 16.0f, (float)((x + y) % 5) / 4.0f });
+		}
+		for (int y = 0; y < 16; y++)
+		{
+			for (int x = 0; x < 16; x++)
+			{
+				int i = y * 17 + x;
+				indices.insert(indices.end(), { i, i + 1, i + 18, i, i + 18, i + 17 });
+			}
+		}
+
+		CHAR_INFO ramp[5];
+		const short shades[5] = { L' ', PIXEL_QUARTER, PIXEL_HALF, PIXEL_THREEQUARTERS, PIXEL_SOLID };
+		for (int i = 0; i < 5; i++)
+		{
+			ramp[i].Char.UnicodeChar = shades[i];
+			ramp[i].Attributes = FG_WHITE;
+		}
+
+		Measure(L"DrawMesh", [&](int i)
+		{
+			DrawMesh(vertices.data(), indices.data(), (int)indices.size() / 3, PIXEL_SOLID, (short)i);
+			return (double)(w * h);
+		}, operations / 100);
+
+		Measure(L"DrawMesh shaded", [&](int i)
+		{
+			DrawMesh(vertices.data(), indices.data(), (int)indices.size() / 3, ramp, 5);
+			return (double)(w * h);
+		}, operations / 100);
+
+		int maxRadius = max(min(w, h) / 4, 1);
+		Measure(L"DrawFilledCircle", [&](int i)
+		{
+			int *v = &p[i * 6];
+			int r = v[2] % maxRadius;
+			DrawFilledCircle(v[0], v[1], r, PIXEL_SOLID, (short)i);
+			return 3.14159265 * r * r;
+		});
+
+		Sprite small(8, 8);
+		Sprite large(48, 32);
+		for (Sprite *sprite : { &small, &large })
+		{
+			for (int y = 0; y < sprite->GetHeight(); y++)
+				for (int x = 0; x < sprite->GetWidth(); x++)
+					sprite->SetColor(x, y, (x + y) % 3 == 0 ? BG_BLACK : BG_RED);
+		}
+
+		Measure(L"DrawSprite 8x8", [&](int i)
+		{
+			int *v = &p[i * 6];
+			DrawSprite(v[0] - 4, v[1] - 4, small);
+			return 64.0;
+		});
+
+		SpriteAtlas atlas(64, 64);
+		SpriteView view = atlas.Add(small);
+		Measure(L"DrawSprite view 8x8", [&](int i)
+		{
+			int *v = &p[i * 6];
+			DrawSprite(v[0] - 4, v[1] - 4, view);
+			return 64.0;
+		});
+
+		Measure(L"DrawSprite 48x32", [&](int i)
+		{
+			int *v = &p[i * 6];
+			DrawSprite(v[0] - 24, v[1] - 16, large);
+			return 48.0 * 32.0;
+		});
+
+		Measure(L"DrawSpriteAlpha 48x32", [&](int i)
+		{
+			int *v = &p[i * 6];
+			DrawSpriteAlpha(v[0] - 24, v[1] - 16, large, BG_BLACK);
+			return 48.0 * 32.0;
+		});
+
+		PlanarSprite planar(large);
+		Measure(L"DrawSprite planar 48x32", [&](int i)
+		{
+			int *v = &p[i * 6];
+			DrawSprite(v[0] - 24, v[1] - 16, planar);
+			return 48.0 * 32.0;
+		});
+
+		Measure(L"DrawSpriteAlpha planar", [&](int i)
+		{
+			int *v = &p[i * 6];
+			DrawSpriteAlpha(v[0] - 24, v[1] - 16, planar, BG_BLACK);
+			return 48.0 * 32.0;
+		});
+
+		Measure(L"DisplayText", [&](int i)
+		{
+			int *v = &p[i * 6];
+			DisplayText(v[0] - 8, v[1], L"Score: 0000000000", BG_BLACK, FG_WHITE);
+			return 17.0;
+		});
+
+		Measure(L"DisplayNumber", [&](int i)
+		{
+			int *v = &p[i * 6];
+			return (double)DisplayNumber(v[0] - 4, v[1], (long long)i * 7919, BG_BLACK, FG_WHITE);
+		});
+
+		//Sprites and circles spread over a few z values, recorded once and executed repeatedly
+		DrawList list;
+		double listCells = 0.0;
+		for (int i = 0; i < 1000; i++)
+		{
+			int *v = &p[i * 6];
+			if (i % 2 == 0)
+			{
+				list.DrawSprite(i % 4, v[0] - 24, v[1] - 16, (i % 4 == 0) ? small : large);
+				listCells += (i % 4 == 0) ? 64.0 : 48.0 * 32.0;
+			}
+			else
+			{
+				int r = v[2] % maxRadius;
+				list.DrawFilledCircle(i % 4, v[0], v[1], r, PIXEL_SOLID, (short)i);
+				listCells += 3.14159265 * r * r;
+			}
+		}
+
+		Measure(L"ExecuteDrawList", [&](int i)
+		{
+			ExecuteDrawList(list);
+			return listCells;
+		}, operations / 1000);
+
+		Measure(L"ExecuteDrawList parallel", [&](int i)
+		{
+			ExecuteDrawList(list, true);
+			return listCells;
+		}, operations / 1000);
+
+		//A rotated, magnified copy of the large sprite over the whole screen, as a raycaster floor would sample it
+		float angle = 0.3f;
+		float du = cosf(angle) / (float)w;
+		float dv = sinf(angle) / (float)w;
+		Measure(L"SampleColor per cell", [&](int i)
+		{
+			for (int y = 0; y < h; y++)
+			{
+				float u = -dv * (float)y;
+				float v = du * (float)y;
+				for (int x = 0; x < w; x++, u += du, v += dv)
+					Draw(w * y + x, large.SampleCharacter(u, v), large.SampleColor(u, v));
+			}
+			return (double)(w * h);
+		}, operations / 100);
+
+		Measure(L"DrawSampledSpan", [&](int i)
+		{
+			for (int y = 0; y < h; y++)
+				DrawSampledSpan(0, y, w, large, -dv * (float)y, du * (float)y, du, dv);
+			return (double)(w * h);
+		}, operations / 100);
+
+		//Every fill covers the whole screen, so fewer iterations are enough
+		Measure(L"FloodFill", [&](int i)
+		{
+			FloodFill(0, 0, (i % 2) ? BG_BLUE : BG_GREEN);
+			return (double)(w * h);
+		}, operations / 100);
+
+		Measure(L"ClearScreen", [&](int i)
+		{
+			ClearScreen(' ', (i % 2) ? BG_BLUE : BG_GREEN);
+			return (double)(w * h);
+		}, operations / 10);
+
+		//A full-screen effect of the kind the worker pool is meant for
+		Measure(L"ParallelForCells", [&](int i)
+		{
+			ParallelForCells([&](int x, int y, CHAR_INFO &cell)
+			{
+				cell.Char.UnicodeChar = PIXEL_SOLID;
+				cell.Attributes = (short)((x * 7 + y * 13 + i) & 0xFF);
+			});
+			return (double)(w * h);
+		}, operations / 10);
+
+		ShadeFade<4> fade(0.5f);
+		PaletteRemap palette;
+		palette.SetForeground(FG_WHITE, FG_RED);
+		AddPostProcess(std::ref(fade));
+		AddPostProcess(std::ref(palette));
+		Measure(L"SwapBuffers post-process", [&](int i)
+		{
+			SwapBuffers();
+			return (double)(w * h);
+		}, operations / 10);
+		ClearPostProcess();
+
+		SetHalfBlockMode(true);
+		Measure(L"SwapBuffers half-block", [&](int i)
+		{
+			FillPixels(0, 0, w - 1, h * 2 - 1, (short)(i & 0x0F));
+			SwapBuffers();
+			return (double)(w * h * 2);
+		}, operations / 10);
+		SetHalfBlockMode(false);
+
+		//Frames are still encoded on a headless screen, only the write is skipped
+		SetOutputBackend(OUTPUT_VT);
+		Measure(L"SwapBuffers VT", [&](int i)
+		{
+			DrawFilledRectangle(0, 0, w - 1, h / 2, PIXEL_SOLID, (short)i);
+			SwapBuffers();
+			return (double)(w * (h / 2 + 1));
+		}, operations / 10);
+		SetOutputBackend(OUTPUT_CONSOLE);
+	}
+
+	void Print(FILE *csv)
+	{
+		wprintf(L"%dx%d\n", GetScreenWidth(), GetScreenHeight());
+		for (const Result &result : results)
+		{
+			wprintf(L"  %-24ls %10.2f Mcells/s %10.1f ns/op\n", result.name, result.cells / result.seconds / 1000000.0, result.seconds * 1000000000.0 / result.operations);
+
+			if (csv != nullptr)
+				fprintf(csv, "%d,%d,%ls,%d,%.0f,%.6f\n", GetScreenWidth(), GetScreenHeight(), result.name, result.operations, result.cells, result.seconds);
+		}
+	}
+
+private:
+	template<typename Primitive>
+	void Measure(const wchar_t* name, Primitive primitive, int count = operations)
+	{
+		ClearScreen();
+
+		double cells = 0.0;
+		auto start = std::chrono::steady_clock::now();
+
+		for (int i = 0; i < count; i++)
+			cells += primitive(i);
+
+		std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+		results.push_back({ name, cells, duration.count(), count });
+	}
+};
+
+int main(int argc, char* argv[])
+{
+	FILE *csv = nullptr;
+	if (argc > 1)
+	{
+		if (fopen_s(&csv, argv[1], "w") != 0)
+			return 1;
+
+		fprintf(csv, "width,height,primitive,operations,cells,seconds\n");
+	}
+
+	const int sizes[][2] = { { 80, 40 }, { 160, 80 }, { 240, 120 } };
+	for (auto &size : sizes)
+	{
+		Benchmark benchmark;
+		if (!benchmark.ConstructHeadless(size[0], size[1]))
+			return 1;
+
+		benchmark.Run();
+		benchmark.Print(csv);
+	}
+
+	if (csv != nullptr)
+		fclose(csv);
+
+	return 0;
+}
@@ -1,55 +1,255 @@
 #pragma once
 
 #pragma comment(lib, "winmm.lib")
+#pragma comment(lib, "ole32.lib")
 
 #include <Windows.h>
+#include <mmdeviceapi.h>
+#include <audioclient.h>
 #include <string>
-#include <queue>
 #include <chrono>
 #include <thread>
 #include <atomic>
 #include <condition_variable>
-#include <list>
+#include <cmath>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <unordered_map>
+#include <functional>
+//Requires C++17
+#include <string_view>
+
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#define CGE_SSE2
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+//AVX2 code paths are compiled regardless of the target architecture and only used if the processor supports them
+#if defined(CGE_SSE2) && (defined(__GNUC__) || defined(__clang__))
+#define CGE_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define CGE_TARGET_AVX2
+#endif
 
 #define DEFAULT_COLOR 0xF0
 #define DEFAULT_CHAR ' '
 
 #define MAX_VOLUME 0xFFFF
 
+//Declared in mmreg.h, which isn't included by Windows.h
+#ifndef WAVE_FORMAT_IEEE_FLOAT
+#define WAVE_FORMAT_IEEE_FLOAT 0x0003
+#endif
+
+#ifndef WAVE_FORMAT_EXTENSIBLE
+#define WAVE_FORMAT_EXTENSIBLE 0xFFFE
+#endif
+
 class ConsoleGameEngine
 {
 	///////////////////////////////////////// CORE /////////////////////////////////////////////////
 
 private:
-	HANDLE console, consoleInput;
-	DWORD originalInput;
+	HANDLE console = INVALID_HANDLE_VALUE, consoleInput = INVALID_HANDLE_VALUE;
+	DWORD originalInput = 0;
+
+	//A headless engine has a screen buffer but no console, nothing is presented and no input is read
+	bool headless = false;
 
 	SMALL_RECT screenArea;
 
-	CHAR_INFO *screen;
+	CHAR_INFO *screen = nullptr;
+
+	//The screen buffer itself, while screen may point at a layer that is being drawn to
+	CHAR_INFO *mainScreen = nullptr;
+
+	int screenWidth = 0, screenHeight = 0;
+
+public:
+	enum PresentMode
+	{
+		PRESENT_FULL,	//Submit the whole screen buffer every frame
+		PRESENT_DIRTY	//Submit only the regions that changed since the last presented frame
+	};
+
+	enum PresentPolicy
+	{
+		PRESENT_BLOCK,			//Wait until the presenter picks up the previous frame
+		PRESENT_DROP,			//Skip the new frame if the previous one has not been picked up yet
+		PRESENT_TRIPLE_BUFFER	//Replace the frame that has not been picked up yet with the new one
+	};
+
+	enum OutputBackend
+	{
+		OUTPUT_CONSOLE,	//Write cells with WriteConsoleOutput using the 16 console colors
+		OUTPUT_VT		//Write virtual terminal escape sequences with 24-bit colors taken from the palette
+	};
+
+	enum ColorMode
+	{
+		COLOR_16,	//Attributes hold the 4-bit foreground and background colors of the console
+		COLOR_256	//Attributes hold an 8-bit foreground in the low and an 8-bit background in the high byte (virtual terminal only)
+	};
+
+private:
+	std::atomic<PresentMode> presentMode = PRESENT_DIRTY;
+
+	//Copy of the last presented frame that is used to find changed regions
+	CHAR_INFO *presentedScreen = nullptr;
+	std::atomic<bool> fullPresentRequired = true;
+
+	//If the changed regions cover more than this fraction of the screen, a single full write is cheaper
+	float dirtyCoalesceRatio = 0.5f;
+
+	std::vector<SMALL_RECT> dirtyRegions;
+
+	std::atomic<OutputBackend> outputBackend = OUTPUT_CONSOLE;
+
+	//Escape sequence parameters of every palette entry, e.g. "38;2;255;0;0" for a red foreground
+	struct VTColor
+	{
+		wchar_t text[20];
+		int length;
+	};
+
+	VTColor vtForeground[256];
+	VTColor vtBackground[256];
+
+	//Colors set by the game are picked up by the encoder before the next frame, since it may run on the presenter thread.
+	//The 16-color mode uses the first 16 entries only.
+	BYTE paletteColors[256][3];
+	std::atomic<bool> paletteChanged = false;
+
+	std::atomic<ColorMode> colorMode = COLOR_16;
+
+	//The whole frame is encoded here and sent with a single write
+	std::vector<wchar_t> vtBuffer;
+	int vtLength = 0;
+
+	//The game draws into the screen (back buffer) while the presenter thread writes the front buffer to the console.
+	//Finished frames are handed over through the pending buffer.
+	bool presentThreadRequested = false;
+	PresentPolicy presentPolicy = PRESENT_BLOCK;
 
-	int screenWidth, screenHeight;
+	CHAR_INFO *pendingBuffer = nullptr;
+	CHAR_INFO *frontBuffer = nullptr;
+	bool framePending = false;
 
-	static std::atomic<bool> running;
-	static std::condition_variable finished;
-	static std::mutex gameMutex;
+	std::atomic<bool> presentThreadActive = false;
+	std::thread presentThread;
+	std::mutex presentMutex;
+	std::condition_variable frameSubmitted;
+	std::condition_variable frameTaken;
+
+	std::atomic<int> droppedFrames = 0;
+
+	//Frame pacing; a target frame rate of zero leaves the loop unthrottled
+	float targetFrameRate = 0.0f;
+	std::chrono::steady_clock::time_point nextFrameTime;
+
+	HANDLE frameTimer = NULL;
+	bool highResolutionTimer = false;
+
+	//Fixed-timestep simulation; a time step of zero disables OnFixedUpdate()
+	float fixedTimeStep = 0.0f;
+	int maxFixedSteps = 8;
+	float fixedTimeAccumulator = 0.0f;
+	float interpolationAlpha = 0.0f;
+
+	//Cleared to end the game loop, either by the game itself or by the close handler
+	std::atomic<bool> running = false;
+
+	//Set under the game mutex once the clean-up after the game loop is done, so that the close handler can wait for it
+	bool finished = true;
+	std::condition_variable finishedCondition;
+	std::mutex gameMutex;
+
+	//Instances whose game loop is running, for the close handler to shut them all down
+	static std::vector<ConsoleGameEngine*> instances;
+	static std::mutex instancesMutex;
+	static bool closeHandlerInstalled;
+
+	//Lock-free queue for passing items from exactly one producer thread to exactly one consumer thread
+	template<typename T, unsigned int Capacity>
+	class RingBuffer
+	{
+		static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0, "RingBuffer capacity must be a power of two");
+
+	private:
+		T items[Capacity];
+
+		//Kept on separate cache lines so that the producer and the consumer don't invalidate each other
+		alignas(64) std::atomic<unsigned int> head = 0;
+		alignas(64) std::atomic<unsigned int> tail = 0;
+
+	public:
+		//Called by the producer only; fails if the queue is full
+		bool Push(const T &item)
+		{
+			unsigned int currentTail = tail.load(std::memory_order_relaxed);
+			if (currentTail - head.load(std::memory_order_acquire) == Capacity)
+				return false;
+
+			items[currentTail & (Capacity - 1)] = item;
+			tail.store(currentTail + 1, std::memory_order_release);
+			return true;
+		}
+
+		//Called by the consumer only; fails if the queue is empty
+		bool Pop(T &item)
+		{
+			unsigned int currentHead = head.load(std::memory_order_relaxed);
+			if (currentHead == tail.load(std::memory_order_acquire))
+				return false;
+
+			item = items[currentHead & (Capacity - 1)];
+			head.store(currentHead + 1, std::memory_order_release);
+			return true;
+		}
+
+		bool IsEmpty() const
+		{
+			return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+		}
+	};
 
 public:
 	ConsoleGameEngine()
 	{
 		SecureZeroMemory(keys, sizeof(KeyState) * 256);
+		ResetPalette();
 	}
 
-	~ConsoleGameEngine() {}
+	~ConsoleGameEngine()
+	{
+		StopRecording();
+		StopWorkers();
+		JoinAudioClipLoaders();
+
+		FreeCells(mainScreen);
+		delete[] presentedScreen;
+		FreeCells(postProcessedScreen);
+	}
 
 	bool ConstructScreen(int width, int height, int pixelWidth, int pixelHeight)
 	{
 		if (width < 1 || height < 1)
 			return Error(L"Console dimensions must be greater than zero.\n");
 
+		//An instance that was headless before presents to the console from now on
+		headless = false;
+
 		screenWidth = width;
 		screenHeight = height;
 
+		//Constructing the screen again replaces the buffer of the previous call
+		if (console != INVALID_HANDLE_VALUE && console != NULL)
+			CloseHandle(console);
+
 		//Acquire needed handles
 		console = CreateConsoleScreenBuffer(GENERIC_READ | GENERIC_WRITE, 0, NULL, CONSOLE_TEXTMODE_BUFFER, NULL);
 		if (console == INVALID_HANDLE_VALUE)
@@ -106,12 +306,7 @@ public:
 		if (!SetConsoleMode(consoleInput, ENABLE_EXTENDED_FLAGS | ENABLE_WINDOW_INPUT | ENABLE_MOUSE_INPUT))
 			return Error(L"SetConsoleMode");
 
-		//Allocate memory for the screen buffer
-		screen = new CHAR_INFO[screenWidth * screenHeight];
-		SecureZeroMemory(screen, sizeof(CHAR_INFO) * screenWidth * screenHeight);
-
-		//Set a routine for application's close signal
-		SetConsoleCtrlHandler((PHANDLER_ROUTINE)CloseHandler, TRUE);
+		AllocateScreen();
 
 		//Disable window resizing
 		HWND consoleWindow = GetConsoleWindow();
@@ -120,7 +315,70 @@ public:
 		return true;
 	}
 
+	//Creates the screen buffer without a console, e.g. for benchmarks and simulations.
+	//Drawing works as usual, while presentation only updates the copy of the presented frame.
+	bool ConstructHeadless(int width, int height)
+	{
+		if (width < 1 || height < 1)
+		{
+			wprintf(L"ERROR: Screen dimensions must be greater than zero.\n");
+			return false;
+		}
+
+		headless = true;
+
+		screenWidth = width;
+		screenHeight = height;
+		screenArea = { 0, 0, (short)(screenWidth - 1), (short)(screenHeight - 1) };
+
+		AllocateScreen();
+
+		return true;
+	}
+
+	bool IsHeadless()
+	{
+		return headless;
+	}
+
 private:
+	//Buffers the worker pool writes to start on a cache line, so that its tiles never share one
+	static CHAR_INFO *AllocateCells(int count)
+	{
+		return (CHAR_INFO*)_aligned_malloc(sizeof(CHAR_INFO) * count, 64);
+	}
+
+	static void FreeCells(CHAR_INFO *cells)
+	{
+		_aligned_free(cells);
+	}
+
+	void AllocateScreen()
+	{
+		//Constructing the screen again replaces everything sized for the previous one, layers included
+		RemoveLayers();
+
+		FreeCells(mainScreen);
+		delete[] presentedScreen;
+		FreeCells(postProcessedScreen);
+		postProcessedScreen = nullptr;
+
+		//Allocate memory for the screen buffer
+		screen = AllocateCells(screenWidth * screenHeight);
+		mainScreen = screen;
+		SecureZeroMemory(screen, sizeof(CHAR_INFO) * screenWidth * screenHeight);
+
+		//Allocate memory for the copy of the presented frame
+		presentedScreen = new CHAR_INFO[screenWidth * screenHeight];
+		SecureZeroMemory(presentedScreen, sizeof(CHAR_INFO) * screenWidth * screenHeight);
+		fullPresentRequired = true;
+
+		dirtyRegions.reserve(screenHeight);
+
+		//Kept whether or not the mode is on, so that the pixel functions always have a buffer of the right size to work on
+		halfBlockPixels.assign((size_t)screenWidth * screenHeight * 2, 0);
+	}
+
 	int Error(const wchar_t* message)
 	{
 		wchar_t lastError[256];
@@ -134,10 +392,27 @@ private:
 public:
 	void Start()
 	{
-		running = true;
+		{
+			std::lock_guard<std::mutex> lock(instancesMutex);
+
+			//Set a routine for application's close signal, shared by every instance
+			if (!closeHandlerInstalled)
+				closeHandlerInstalled = SetConsoleCtrlHandler((PHANDLER_ROUTINE)CloseHandler, TRUE) != FALSE;
+
+			{
+				std::lock_guard<std::mutex> gameLock(gameMutex);
+				finished = false;
+			}
+
+			running = true;
+			instances.push_back(this);
+		}
 
 		std::thread gameThread = std::thread(&ConsoleGameEngine::GameThread, this);
 		gameThread.join();
+
+		std::lock_guard<std::mutex> lock(instancesMutex);
+		instances.erase(std::remove(instances.begin(), instances.end(), this), instances.end());
 	}
 
 private:
@@ -146,1175 +421,6851 @@ private:
 		if (!OnStart())
 			running = false;
 
-		auto t1 = std::chrono::system_clock::now();
-		auto t2 = std::chrono::system_clock::now();
+		if (running && presentThreadRequested)
+			StartPresentThread();
+
+		if (running && inputThreadRequested && !headless)
+			StartInputThread();
+
+		auto t1 = std::chrono::steady_clock::now();
+		auto t2 = std::chrono::steady_clock::now();
+
+		nextFrameTime = t1;
+		fixedTimeAccumulator = 0.0f;
 
 		while (running)
 		{
 			//Find time difference between current and previous frames
-			t2 = std::chrono::system_clock::now();
+			t2 = std::chrono::steady_clock::now();
 			std::chrono::duration<float> duration = t2 - t1;
 			float elapsedTime = duration.count();
 			t1 = t2;
 
+			auto mark = t2;
+			frameStartTime = t2;
+			frameElapsedTime = elapsedTime;
+
 			ReadInput();
+			mark = MarkPhase(PHASE_INPUT, mark);
 
-			if (!OnUpdate(elapsedTime))
+			if (fixedTimeStep > 0.0f)
+			{
+				RunFixedUpdates(elapsedTime);
+				mark = MarkPhase(PHASE_FIXED_UPDATE, mark);
+			}
+
+			//OnUpdate isn't called anymore once a fixed update has quit
+			if (running && !OnUpdate(elapsedTime))
 				running = false;
+			mark = MarkPhase(PHASE_UPDATE, mark);
+
+			//Audio commands that didn't fit into the queue during the update
+			if (!deferredAudioCommands.empty())
+				SendDeferredAudioCommands();
+
+			if (halfBlockMode)
+				PackHalfBlocks();
+
+			CompositeLayers();
+
+			if (profilerOverlayVisible)
+				DrawProfilerOverlay();
+
+			const CHAR_INFO *frame = ApplyPostProcess();
+			mark = MarkPhase(PHASE_POST_PROCESS, mark);
 
-			WriteConsoleOutput(console, screen, { (short)screenWidth, (short)screenHeight }, { 0, 0 }, &screenArea);
+			SubmitFrame(frame);
+			mark = MarkPhase(PHASE_PRESENT, mark);
+
+			EndProfiledFrame(elapsedTime);
 
 			//If game is finished, check whether it's allowed to exit or not and perform clean-up
 			if (!running)
 			{
 				if (OnDestroy())
 				{
+					StopRecording();
+					StopWorkers();
+					StopPresentThread();
+					StopInputThread();
 					DestroyAudio();
-					for (auto &clip : audioClips)
-						delete[] clip.data;
-
-					delete[] screen;
-					SetConsoleMode(consoleInput, originalInput);
-					CloseHandle(console);
-					finished.notify_one();
+					audioClips.clear();
+					audioClipCache.clear();
+					retiredAudioClips.clear();
+
+					FreeCells(mainScreen);
+					delete[] presentedScreen;
+					FreeCells(postProcessedScreen);
+					screen = nullptr;
+					mainScreen = nullptr;
+					presentedScreen = nullptr;
+					postProcessedScreen = nullptr;
+					DestroyFrameTimer();
+					if (!headless)
+					{
+						SetConsoleMode(consoleInput, originalInput);
+						CloseHandle(console);
+					}
 				}
 				else
 					running = true;
 			}
+
+			if (running && targetFrameRate > 0.0f)
+				WaitForNextFrame();
+		}
+
+		//Also reached when OnStart() fails, so the close handler never waits for a game loop that didn't run
+		{
+			std::lock_guard<std::mutex> lock(gameMutex);
+			finished = true;
 		}
+		finishedCondition.notify_all();
 	}
 
-	static BOOL CloseHandler(DWORD evt)
+	void RunFixedUpdates(float elapsedTime)
 	{
-		if (evt == CTRL_CLOSE_EVENT)
+		fixedTimeAccumulator += elapsedTime;
+
+		int steps = 0;
+		while (fixedTimeAccumulator >= fixedTimeStep && steps < maxFixedSteps)
 		{
-			running = false;
+			fixedTimeAccumulator -= fixedTimeStep;
+			steps++;
 
-			std::unique_lock<std::mutex> lock(gameMutex);
-			finished.wait(lock);
+			//Quitting stops the catch-up as well, the remaining steps would only simulate a game that has ended
+			if (!OnFixedUpdate(fixedTimeStep))
+			{
+				running = false;
+				break;
+			}
 		}
-		return true;
-	}
 
-protected:
-	int GetScreenWidth()
-	{
-		return screenWidth;
-	}
+		//If the simulation can't keep up, drop the time it is behind instead of trying to catch up forever
+		if (fixedTimeAccumulator >= fixedTimeStep)
+			fixedTimeAccumulator = fmodf(fixedTimeAccumulator, fixedTimeStep);
 
-	int GetScreenHeight()
-	{
-		return screenHeight;
+		interpolationAlpha = fixedTimeAccumulator / fixedTimeStep;
 	}
 
-	short GetScreenCharacter(int i)
+	void WaitForNextFrame()
 	{
-		return screen[i].Char.UnicodeChar;
-	}
+		auto frameDuration = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(1.0f / targetFrameRate));
+		auto now = std::chrono::steady_clock::now();
 
-	short GetScreenCharacter(int x, int y)
-	{
-		return screen[screenWidth * y + x].Char.UnicodeChar;
-	}
+		nextFrameTime += frameDuration;
 
-	short GetScreenColor(int i)
-	{
-		return screen[i].Attributes;
+		//If the frame took longer than planned, start counting from now rather than rushing the next few frames
+		if (nextFrameTime < now)
+		{
+			nextFrameTime = now;
+			return;
+		}
+
+		if (frameTimer == NULL)
+			CreateFrameTimer();
+
+		//Sleep on the timer for most of the remaining time and spin for the rest, since timers may wake up late
+		auto spinMargin = highResolutionTimer ? std::chrono::microseconds(250) : std::chrono::microseconds(2000);
+		auto sleepDuration = nextFrameTime - now - spinMargin;
+
+		if (frameTimer != NULL && sleepDuration > std::chrono::steady_clock::duration::zero())
+		{
+			//Relative due time is negative and measured in 100 nanosecond intervals
+			LARGE_INTEGER dueTime;
+			dueTime.QuadPart = -(LONGLONG)(std::chrono::duration_cast<std::chrono::nanoseconds>(sleepDuration).count() / 100);
+
+			if (SetWaitableTimer(frameTimer, &dueTime, 0, NULL, NULL, FALSE))
+				WaitForSingleObject(frameTimer, INFINITE);
+		}
+
+		while (std::chrono::steady_clock::now() < nextFrameTime)
+			YieldProcessor();
 	}
 
-	short GetScreenColor(int x, int y)
+	void CreateFrameTimer()
 	{
-		return screen[screenWidth * y + x].Attributes;
+		frameTimer = CreateWaitableTimerEx(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+		highResolutionTimer = frameTimer != NULL;
+
+		//High resolution timers are not available before Windows 10 1803, fall back to a regular timer with a finer system clock
+		if (frameTimer == NULL)
+		{
+			frameTimer = CreateWaitableTimer(NULL, TRUE, NULL);
+			timeBeginPeriod(1);
+		}
 	}
 
-	void SetApplicationTitle(LPCWSTR title)
+	void DestroyFrameTimer()
 	{
-		SetConsoleTitle(title);
-	}
+		if (frameTimer == NULL)
+			return;
 
-	virtual bool OnStart() { return true; }
+		if (!highResolutionTimer)
+			timeEndPeriod(1);
 
-	virtual bool OnUpdate(float elapsedTime) = 0;
+		CloseHandle(frameTimer);
+		frameTimer = NULL;
+	}
 
-	virtual bool OnDestroy() { return true; }
+	void StartPresentThread()
+	{
+		pendingBuffer = new CHAR_INFO[screenWidth * screenHeight];
+		frontBuffer = new CHAR_INFO[screenWidth * screenHeight];
+		framePending = false;
+		droppedFrames = 0;
 
-	//////////////////////////////////////// RENDER ////////////////////////////////////////////////
+		presentThreadActive = true;
+		presentThread = std::thread(&ConsoleGameEngine::PresentThread, this);
+	}
 
-public:
-	enum Color
+	void StopPresentThread()
 	{
-		FG_BLACK = 0x00,
-		FG_DARK_BLUE = 0x01,
-		FG_DARK_GREEN = 0x02,
-		FG_DARK_CYAN = 0x03,
-		FG_DARK_RED = 0x04,
-		FG_DARK_PINK = 0x05,
-		FG_DARK_YELLOW = 0x06,
-		FG_GRAY = 0x07,
-		FG_DARK_GRAY = 0x08,
-		FG_BLUE = 0x09,
-		FG_GREEN = 0xA,
-		FG_CYAN = 0xB,
-		FG_RED = 0xC,
-		FG_PINK = 0xD,
-		FG_YELLOW = 0xE,
-		FG_WHITE = 0xF,
+		if (!presentThreadActive)
+			return;
 
-		BG_BLACK = 0x00,
-		BG_DARK_BLUE = 0x10,
-		BG_DARK_GREEN = 0x20,
-		BG_DARK_CYAN = 0x30,
-		BG_DARK_RED = 0x40,
-		BG_DARK_PINK = 0x50,
-		BG_DARK_YELLOW = 0x60,
-		BG_GRAY = 0x70,
-		BG_DARK_GRAY = 0x80,
-		BG_BLUE = 0x90,
-		BG_GREEN = 0xA0,
-		BG_CYAN = 0xB0,
-		BG_RED = 0xC0,
-		BG_PINK = 0xD0,
-		BG_YELLOW = 0xE0,
-		BG_WHITE = 0xF0
-	};
+		{
+			std::unique_lock<std::mutex> lock(presentMutex);
+			presentThreadActive = false;
+		}
+		frameSubmitted.notify_one();
 
-	enum PIXEL_TYPE
-	{
-		PIXEL_QUARTER = 0x2591,
-		PIXEL_HALF = 0x2592,
-		PIXEL_THREEQUARTERS = 0x2593,
-		PIXEL_SOLID = 0x2588
-	};
+		if (presentThread.joinable())
+			presentThread.join();
 
-	class Sprite
+		delete[] pendingBuffer;
+		delete[] frontBuffer;
+		pendingBuffer = nullptr;
+		frontBuffer = nullptr;
+	}
+
+	void PresentThread()
 	{
-	private:
-		int width = 0;
-		int height = 0;
+		while (true)
+		{
+			{
+				std::unique_lock<std::mutex> lock(presentMutex);
+				frameSubmitted.wait(lock, [this] { return framePending || !presentThreadActive; });
 
-		CHAR_INFO *contents = nullptr;
+				//Present the last submitted frame before leaving
+				if (!framePending)
+					break;
 
-	public:
-		Sprite() {}
+				std::swap(pendingBuffer, frontBuffer);
+				framePending = false;
+			}
+			frameTaken.notify_one();
 
-		Sprite(int width, int height)
-		{
-			Create(width, height);
+			PresentScreen(frontBuffer);
 		}
+	}
 
-		Sprite(std::wstring fileName)
+	void PresentScreen(const CHAR_INFO *buffer)
+	{
+		if (presentMode == PRESENT_FULL)
 		{
-			if (!Load(fileName))
-				Create(8, 8);
-		}
+			WriteScreenRegions(buffer, &screenArea, 1);
 
-		~Sprite()
-		{
-			delete[] contents;
+			//The copy is not maintained in this mode, so it has to be refreshed once dirty presentation is back on
+			fullPresentRequired = true;
+			return;
 		}
 
-		int GetWidth()
+		if (fullPresentRequired)
 		{
-			return width;
+			WriteScreenRegions(buffer, &screenArea, 1);
+			memcpy(presentedScreen, buffer, sizeof(CHAR_INFO) * screenWidth * screenHeight);
+			fullPresentRequired = false;
+			return;
 		}
 
-		int GetHeight()
+		//Escape sequences are written row by row anyway, so separate spans only save the unchanged cells in between
+		bool vt = outputBackend == OUTPUT_VT;
+		FindDirtyRegions(buffer, !vt);
+
+		int dirtyArea = 0;
+		for (const SMALL_RECT &region : dirtyRegions)
+			dirtyArea += (region.Right - region.Left + 1) * (region.Bottom - region.Top + 1);
+
+		if (dirtyArea == 0)
+			return;
+
+		if (!vt && dirtyArea > (int)(dirtyCoalesceRatio * (float)(screenWidth * screenHeight)))
 		{
-			return height;
+			WriteScreenRegions(buffer, &screenArea, 1);
+			return;
 		}
 
-		bool Create(int width, int height)
-		{
-			if (width <= 0 || height <= 0) return false;
-
-			this->width = width;
-			this->height = height;
+		WriteScreenRegions(buffer, dirtyRegions.data(), (int)dirtyRegions.size());
+	}
 
-			delete[] contents;
-			contents = new CHAR_INFO[width * height];
+	void WriteScreenRegions(const CHAR_INFO *buffer, const SMALL_RECT *regions, int count)
+	{
+		if (outputBackend == OUTPUT_VT)
+		{
+			//The frame is still encoded without a console, so that the encoder can be measured
+			EncodeVT(buffer, regions, count);
 
-			for (int i = 0; i < width * height; i++)
+			if (!headless)
 			{
-				contents[i].Char.UnicodeChar = ' ';
-				contents[i].Attributes = BG_BLACK;
+				DWORD written;
+				WriteConsoleW(console, vtBuffer.data(), vtLength, &written, NULL);
 			}
+			return;
+		}
 
-			return true;
+		if (headless)
+			return;
+
+		for (int i = 0; i < count; i++)
+		{
+			//The region is passed by value since the call updates it
+			SMALL_RECT region = regions[i];
+			WriteConsoleOutput(console, buffer, { (short)screenWidth, (short)screenHeight }, { region.Left, region.Top }, &region);
 		}
+	}
 
-		void Copy(const Sprite& sprite)
+	//Encodes the regions as escape sequences into the VT buffer. Every row of a region starts with a cursor jump,
+	//so the cells outside of the regions are skipped, and colors are only emitted when they differ from the previous cell.
+	void EncodeVT(const CHAR_INFO *buffer, const SMALL_RECT *regions, int count)
+	{
+		//Worst case is a cursor jump per row and both colors for every cell
+		size_t capacity = 16 + (size_t)screenHeight * 16 + (size_t)screenWidth * screenHeight * 40;
+		if (vtBuffer.size() < capacity)
+			vtBuffer.resize(capacity);
+
+		if (paletteChanged)
+			UpdateVTPalette();
+
+		wchar_t *out = vtBuffer.data();
+
+		//Hide the cursor, since the console cursor info does not apply to the terminal
+		for (const wchar_t *c = L"\x1b[?25l"; *c; c++)
+			*out++ = *c;
+
+		//The terminal state after the previous frame is unknown, so the first cell always sets both colors
+		int foreground = -1;
+		int background = -1;
+
+		const bool wide = colorMode == COLOR_256;
+		const int colorMask = wide ? 0xFF : 0x0F;
+		const int backgroundShift = wide ? 8 : 4;
+
+		for (int i = 0; i < count; i++)
 		{
-			Create(sprite.width, sprite.height);
+			const SMALL_RECT &region = regions[i];
 
-			for (int i = 0; i < width; i++)
+			for (int y = region.Top; y <= region.Bottom; y++)
 			{
-				for (int j = 0; j < height; j++)
+				*out++ = L'\x1b';
+				*out++ = L'[';
+				out = WriteNumber(out, y + 1);
+				*out++ = L';';
+				out = WriteNumber(out, region.Left + 1);
+				*out++ = L'H';
+
+				const CHAR_INFO *row = buffer + screenWidth * y;
+				for (int x = region.Left; x <= region.Right; x++)
 				{
-					SetCharacter(i, j, sprite.GetCharacter(i, j));
-					SetColor(i, j, sprite.GetColor(i, j));
+					int fg = row[x].Attributes & colorMask;
+					int bg = (row[x].Attributes >> backgroundShift) & colorMask;
+
+					if (fg != foreground || bg != background)
+					{
+						*out++ = L'\x1b';
+						*out++ = L'[';
+
+						if (fg != foreground)
+						{
+							memcpy(out, vtForeground[fg].text, sizeof(wchar_t) * vtForeground[fg].length);
+							out += vtForeground[fg].length;
+						}
+
+						if (bg != background)
+						{
+							if (fg != foreground)
+								*out++ = L';';
+
+							memcpy(out, vtBackground[bg].text, sizeof(wchar_t) * vtBackground[bg].length);
+							out += vtBackground[bg].length;
+						}
+
+						*out++ = L'm';
+						foreground = fg;
+						background = bg;
+					}
+
+					//Control characters would be interpreted by the terminal
+					wchar_t character = row[x].Char.UnicodeChar;
+					*out++ = (character < L' ' || character == 0x7F) ? L' ' : character;
 				}
 			}
 		}
 
-		void SetCharacter(int x, int y, short character)
+		vtLength = (int)(out - vtBuffer.data());
+	}
+
+	static wchar_t *WriteNumber(wchar_t *out, unsigned long long value)
+	{
+		wchar_t digits[20];
+		int count = 0;
+
+		do
 		{
-			if (x < 0 || x >= width || y < 0 || y >= height) return;
-			contents[width * y + x].Char.UnicodeChar = character;
-		}
+			digits[count++] = (wchar_t)(L'0' + value % 10);
+			value /= 10;
+		} while (value > 0);
 
-		short GetCharacter(int x, int y)
+		while (count > 0)
+			*out++ = digits[--count];
+
+		return out;
+	}
+
+	static void FormatVTColor(VTColor &color, int layer, BYTE r, BYTE g, BYTE b)
+	{
+		wchar_t *out = color.text;
+		out = WriteNumber(out, layer);
+		*out++ = L';';
+		*out++ = L'2';
+		*out++ = L';';
+		out = WriteNumber(out, r);
+		*out++ = L';';
+		out = WriteNumber(out, g);
+		*out++ = L';';
+		out = WriteNumber(out, b);
+		color.length = (int)(out - color.text);
+	}
+
+	void ResetPalette()
+	{
+		//Default colors of the Windows console
+		static const BYTE palette[16][3] =
 		{
-			if (x < 0 || x >= width || y < 0 || y >= height) return ' ';
-			return contents[width * y + x].Char.UnicodeChar;
-		}
+			{ 12, 12, 12 }, { 0, 55, 218 }, { 19, 161, 14 }, { 58, 150, 221 },
+			{ 197, 15, 31 }, { 136, 23, 152 }, { 193, 156, 0 }, { 204, 204, 204 },
+			{ 118, 118, 118 }, { 59, 120, 255 }, { 22, 198, 12 }, { 97, 214, 214 },
+			{ 231, 72, 86 }, { 180, 0, 158 }, { 249, 241, 165 }, { 242, 242, 242 }
+		};
 
-		const short GetCharacter(int x, int y) const
+		memcpy(paletteColors, palette, sizeof(palette));
+
+		//The rest follows the 256-color palette of xterm: a 6x6x6 color cube and a ramp of 24 grays
+		static const BYTE levels[6] = { 0, 95, 135, 175, 215, 255 };
+		for (int i = 0; i < 216; i++)
 		{
-			if (x < 0 || x >= width || y < 0 || y >= height) return ' ';
-			return contents[width * y + x].Char.UnicodeChar;
+			paletteColors[16 + i][0] = levels[i / 36];
+			paletteColors[16 + i][1] = levels[(i / 6) % 6];
+			paletteColors[16 + i][2] = levels[i % 6];
 		}
 
-		void SetColor(int x, int y, short color)
+		for (int i = 0; i < 24; i++)
+			memset(paletteColors[232 + i], 8 + i * 10, 3);
+
+		paletteChanged = true;
+	}
+
+	void UpdateVTPalette()
+	{
+		std::unique_lock<std::mutex> lock(presentMutex);
+
+		for (int i = 0; i < 256; i++)
 		{
-			if (x < 0 || x >= width || y < 0 || y >= height) return;
-			contents[width * y + x].Attributes = color;
+			FormatVTColor(vtForeground[i], 38, paletteColors[i][0], paletteColors[i][1], paletteColors[i][2]);
+			FormatVTColor(vtBackground[i], 48, paletteColors[i][0], paletteColors[i][1], paletteColors[i][2]);
 		}
+		paletteChanged = false;
+	}
 
-		short GetColor(int x, int y)
+	//Compares the buffer against the last presented frame (updating it along the way) and collects rectangles
+	//of changed cells. Changed spans of adjacent rows are merged together when they overlap or touch, unless disabled.
+	void FindDirtyRegions(const CHAR_INFO *buffer, bool mergeRows = true)
+	{
+		dirtyRegions.clear();
+
+		for (int y = 0; y < screenHeight; y++)
 		{
-			if (x < 0 || x >= width || y < 0 || y >= height) return BG_BLACK;
-			return contents[width * y + x].Attributes;
+			const CHAR_INFO *row = buffer + screenWidth * y;
+			CHAR_INFO *presentedRow = presentedScreen + screenWidth * y;
+
+			if (memcmp(row, presentedRow, sizeof(CHAR_INFO) * screenWidth) == 0)
+				continue;
+
+			int left = 0;
+			while (IsSameCell(row[left], presentedRow[left]))
+				left++;
+
+			int right = screenWidth - 1;
+			while (IsSameCell(row[right], presentedRow[right]))
+				right--;
+
+			memcpy(presentedRow + left, row + left, sizeof(CHAR_INFO) * (right - left + 1));
+
+			if (mergeRows && !dirtyRegions.empty())
+			{
+				SMALL_RECT &last = dirtyRegions.back();
+				if (last.Bottom == y - 1 && left <= last.Right + 1 && right >= last.Left - 1)
+				{
+					last.Left = min(last.Left, (short)left);
+					last.Right = max(last.Right, (short)right);
+					last.Bottom = (short)y;
+					continue;
+				}
+			}
+
+			dirtyRegions.push_back({ (short)left, (short)y, (short)right, (short)y });
 		}
+	}
 
-		const short GetColor(int x, int y) const
+	static bool IsSameCell(const CHAR_INFO &a, const CHAR_INFO &b)
+	{
+		return a.Char.UnicodeChar == b.Char.UnicodeChar && a.Attributes == b.Attributes;
+	}
+
+	static BOOL CloseHandler(DWORD evt)
+	{
+		if (evt == CTRL_CLOSE_EVENT)
 		{
-			if (x < 0 || x >= width || y < 0 || y >= height) return BG_BLACK;
-			return contents[width * y + x].Attributes;
+			//Instances can't leave the registry while it's locked, so all of them stay alive until their clean-up is done
+			std::lock_guard<std::mutex> instancesLock(instancesMutex);
+
+			for (ConsoleGameEngine *instance : instances)
+				instance->running = false;
+
+			for (ConsoleGameEngine *instance : instances)
+			{
+				std::unique_lock<std::mutex> lock(instance->gameMutex);
+				instance->finishedCondition.wait(lock, [instance]() { return instance->finished; });
+			}
 		}
+		return true;
+	}
 
-		short SampleCharacter(float x, float y)
-		{
-			int sx = (int)(x * (float)width);
-			int sy = (int)(y * (float)height);
+protected:
+	int GetScreenWidth()
+	{
+		return screenWidth;
+	}
 
-			if (sx < 0)
-				sx = 0;
-			else if (sx >= width)
-				sx = width - 1;
+	int GetScreenHeight()
+	{
+		return screenHeight;
+	}
 
-			if (sy < 0)
-				sy = 0;
-			else if (sy >= height)
-				sy = height - 1;
+	short GetScreenCharacter(int i)
+	{
+		return screen[i].Char.UnicodeChar;
+	}
 
-			return contents[width * sy + sx].Char.UnicodeChar;
-		}
+	short GetScreenCharacter(int x, int y)
+	{
+		return screen[screenWidth * y + x].Char.UnicodeChar;
+	}
 
-		short SampleColor(float x, float y)
-		{
-			int sx = (int)(x * (float)width);
-			int sy = (int)(y * (float)height);
+	short GetScreenColor(int i)
+	{
+		return screen[i].Attributes;
+	}
 
-			if (sx < 0)
-				sx = 0;
-			else if (sx >= width)
-				sx = width - 1;
+	short GetScreenColor(int x, int y)
+	{
+		return screen[screenWidth * y + x].Attributes;
+	}
 
-			if (sy < 0)
-				sy = 0;
-			else if (sy >= height)
-				sy = height - 1;
+	void SetApplicationTitle(LPCWSTR title)
+	{
+		SetConsoleTitle(title);
+	}
 
-			return contents[width * sy + sx].Attributes;
+	void SetPresentMode(PresentMode mode)
+	{
+		presentMode = mode;
+		fullPresentRequired = true;
+	}
+
+	PresentMode GetPresentMode()
+	{
+		return presentMode;
+	}
+
+	//Switches between console cell output and virtual terminal escape sequences. The latter requires a console
+	//that supports virtual terminal processing; if it does not, the backend stays unchanged and false is returned.
+	bool SetOutputBackend(OutputBackend backend)
+	{
+		if (!headless)
+		{
+			DWORD mode;
+			if (!GetConsoleMode(console, &mode))
+				return false;
+
+			if (backend == OUTPUT_VT)
+				mode |= ENABLE_PROCESSED_OUTPUT | ENABLE_VIRTUAL_TERMINAL_PROCESSING | DISABLE_NEWLINE_AUTO_RETURN;
+			else
+				mode &= ~(ENABLE_VIRTUAL_TERMINAL_PROCESSING | DISABLE_NEWLINE_AUTO_RETURN);
+
+			if (!SetConsoleMode(console, mode))
+				return false;
 		}
 
-		bool Save(std::wstring fileName)
+		//Console cells can't hold the wider attributes
+		if (backend == OUTPUT_CONSOLE)
+			colorMode = COLOR_16;
+
+		outputBackend = backend;
+		fullPresentRequired = true;
+		return true;
+	}
+
+	//Selects how the virtual terminal backend reads the attributes of a cell. With COLOR_256, up to 256 foreground and
+	//256 background colors can be on the screen at once, each one an entry of the palette that can be set to any 24-bit color.
+	//Requires the virtual terminal backend and returns false otherwise. Half-block pixels stay limited to the 16 colors.
+	bool SetColorMode(ColorMode mode)
+	{
+		if (mode == COLOR_256 && outputBackend != OUTPUT_VT)
+			return false;
+
+		colorMode = mode;
+		fullPresentRequired = true;
+		return true;
+	}
+
+	ColorMode GetColorMode()
+	{
+		return colorMode;
+	}
+
+	//Attributes of a cell in the 256-color mode
+	static short MakeColor256(BYTE foreground, BYTE background)
+	{
+		return (short)(foreground | (background << 8));
+	}
+
+	OutputBackend GetOutputBackend()
+	{
+		return outputBackend;
+	}
+
+	//Changes the 24-bit color used for a palette entry by the virtual terminal backend. Entries 0-15 are the console colors,
+	//the others are only used in the 256-color mode.
+	void SetPaletteColor(int index, BYTE r, BYTE g, BYTE b)
+	{
+		if (index < 0 || index >= 256)
+			return;
+
 		{
-			FILE *file = nullptr;
-			if (_wfopen_s(&file, fileName.c_str(), L"wb") != 0) return false;
+			std::unique_lock<std::mutex> lock(presentMutex);
+			paletteColors[index][0] = r;
+			paletteColors[index][1] = g;
+			paletteColors[index][2] = b;
+		}
+		paletteChanged = true;
+		fullPresentRequired = true;
+	}
 
-			fwrite(&width, sizeof(int), 1, file);
-			fwrite(&height, sizeof(int), 1, file);
-			fwrite(contents, sizeof(CHAR_INFO), width * height, file);
+	//Presents frames from a separate thread so that the next frame can be simulated in the meantime.
+	//Must be called before Start() or from OnStart().
+	void EnablePresentThread(PresentPolicy policy = PRESENT_BLOCK)
+	{
+		presentThreadRequested = true;
+		presentPolicy = policy;
+	}
 
-			fclose(file);
+	void SetPresentPolicy(PresentPolicy policy)
+	{
+		std::unique_lock<std::mutex> lock(presentMutex);
+		presentPolicy = policy;
+	}
 
-			return true;
+	//Number of frames that were never presented because the presenter was falling behind
+	int GetDroppedFrames()
+	{
+		return droppedFrames;
+	}
+
+	//Limits the game loop to the given number of frames per second; zero removes the limit
+	void SetTargetFrameRate(float framesPerSecond)
+	{
+		if (framesPerSecond < 0.0f)
+			framesPerSecond = 0.0f;
+
+		targetFrameRate = framesPerSecond;
+		nextFrameTime = std::chrono::steady_clock::now();
+	}
+
+	float GetTargetFrameRate()
+	{
+		return targetFrameRate;
+	}
+
+	//Calls OnFixedUpdate() with a constant time step (in seconds) before every OnUpdate(), as many times as the elapsed time requires.
+	//At most maxStepsPerFrame steps are performed per frame. A time step of zero disables fixed updates.
+	void SetFixedTimeStep(float timeStep, int maxStepsPerFrame = 8)
+	{
+		if (timeStep < 0.0f)
+			timeStep = 0.0f;
+
+		fixedTimeStep = timeStep;
+		maxFixedSteps = max(maxStepsPerFrame, 1);
+		fixedTimeAccumulator = 0.0f;
+		interpolationAlpha = 0.0f;
+	}
+
+	//Fraction of the fixed time step that has accumulated since the last OnFixedUpdate(), useful for interpolating rendered state
+	float GetInterpolationAlpha()
+	{
+		return interpolationAlpha;
+	}
+
+	//Hands the finished frame over for presentation. Called automatically after every OnUpdate().
+	void SwapBuffers()
+	{
+		if (halfBlockMode)
+			PackHalfBlocks();
+
+		CompositeLayers();
+
+		SubmitFrame(ApplyPostProcess());
+	}
+
+private:
+	void SubmitFrame(const CHAR_INFO *frame)
+	{
+		if (captureView != nullptr)
+			RecordFrame(frame);
+
+		if (!presentThreadActive)
+		{
+			PresentScreen(frame);
+			return;
 		}
 
-		bool Load(std::wstring fileName)
 		{
-			width = 0;
-			height = 0;
-			delete[] contents;
+			std::unique_lock<std::mutex> lock(presentMutex);
 
-			FILE *file = nullptr;
-			if (_wfopen_s(&file, fileName.c_str(), L"rb") != 0) return false;
+			if (framePending)
+			{
+				switch (presentPolicy)
+				{
+					case PRESENT_BLOCK:
+						frameTaken.wait(lock, [this] { return !framePending; });
+						break;
+					case PRESENT_DROP:
+						droppedFrames++;
+						return;
+					case PRESENT_TRIPLE_BUFFER:
+						droppedFrames++;
+						break;
+				}
+			}
+
+			//The back buffer keeps its contents, since games are free to draw over the previous frame
+			memcpy(pendingBuffer, frame, sizeof(CHAR_INFO) * screenWidth * screenHeight);
+			framePending = true;
+		}
+		frameSubmitted.notify_one();
+	}
 
-			fread(&width, sizeof(int), 1, file);
-			fread(&height, sizeof(int), 1, file);
+protected:
 
-			Create(width, height);
+	//Fraction of the screen (0 to 1) above which changed regions are presented with a single full write
+	void SetDirtyCoalesceRatio(float ratio)
+	{
+		if (ratio < 0.0f)
+			ratio = 0.0f;
+		else if (ratio > 1.0f)
+			ratio = 1.0f;
+
+		dirtyCoalesceRatio = ratio;
+	}
+
+	virtual bool OnStart() { return true; }
+
+	virtual bool OnUpdate(float elapsedTime) = 0;
+
+	virtual bool OnFixedUpdate(float fixedTimeStep) { return true; }
+
+	virtual bool OnDestroy() { return true; }
+
+	//////////////////////////////////////// RENDER ////////////////////////////////////////////////
+
+public:
+	enum Color
+	{
+		FG_BLACK = 0x00,
+		FG_DARK_BLUE = 0x01,
+		FG_DARK_GREEN = 0x02,
+		FG_DARK_CYAN = 0x03,
+		FG_DARK_RED = 0x04,
+		FG_DARK_PINK = 0x05,
+		FG_DARK_YELLOW = 0x06,
+		FG_GRAY = 0x07,
+		FG_DARK_GRAY = 0x08,
+		FG_BLUE = 0x09,
+		FG_GREEN = 0xA,
+		FG_CYAN = 0xB,
+		FG_RED = 0xC,
+		FG_PINK = 0xD,
+		FG_YELLOW = 0xE,
+		FG_WHITE = 0xF,
+
+		BG_BLACK = 0x00,
+		BG_DARK_BLUE = 0x10,
+		BG_DARK_GREEN = 0x20,
+		BG_DARK_CYAN = 0x30,
+		BG_DARK_RED = 0x40,
+		BG_DARK_PINK = 0x50,
+		BG_DARK_YELLOW = 0x60,
+		BG_GRAY = 0x70,
+		BG_DARK_GRAY = 0x80,
+		BG_BLUE = 0x90,
+		BG_GREEN = 0xA0,
+		BG_CYAN = 0xB0,
+		BG_RED = 0xC0,
+		BG_PINK = 0xD0,
+		BG_YELLOW = 0xE0,
+		BG_WHITE = 0xF0
+	};
+
+	enum PIXEL_TYPE
+	{
+		PIXEL_QUARTER = 0x2591,
+		PIXEL_HALF = 0x2592,
+		PIXEL_THREEQUARTERS = 0x2593,
+		PIXEL_SOLID = 0x2588,
+		PIXEL_UPPER_HALF = 0x2580,
+		PIXEL_LOWER_HALF = 0x2584
+	};
+
+	//Which part of the cells FloodFill matches and replaces
+	enum FloodFillMode
+	{
+		FILL_COLOR,
+		FILL_CHARACTER,
+		FILL_BOTH
+	};
+
+	class Sprite
+	{
+	private:
+		int width = 0;
+		int height = 0;
+
+		CHAR_INFO *contents = nullptr;
+
+	public:
+		Sprite() {}
+
+		Sprite(int width, int height)
+		{
+			Create(width, height);
+		}
+
+		Sprite(std::wstring fileName)
+		{
+			if (!Load(fileName))
+				Create(8, 8);
+		}
+
+		Sprite(const Sprite& sprite)
+		{
+			Copy(sprite);
+		}
+
+		Sprite(Sprite&& sprite) noexcept : width(sprite.width), height(sprite.height), contents(sprite.contents)
+		{
+			sprite.width = 0;
+			sprite.height = 0;
+			sprite.contents = nullptr;
+		}
+
+		Sprite& operator=(const Sprite& sprite)
+		{
+			if (this != &sprite)
+				Copy(sprite);
+
+			return *this;
+		}
+
+		Sprite& operator=(Sprite&& sprite) noexcept
+		{
+			if (this != &sprite)
+			{
+				delete[] contents;
+
+				width = sprite.width;
+				height = sprite.height;
+				contents = sprite.contents;
+
+				sprite.width = 0;
+				sprite.height = 0;
+				sprite.contents = nullptr;
+			}
+
+			return *this;
+		}
+
+		~Sprite()
+		{
+			delete[] contents;
+		}
+
+		int GetWidth() const
+		{
+			return width;
+		}
+
+		int GetHeight() const
+		{
+			return height;
+		}
+
+		//Cells are stored row by row
+		CHAR_INFO* GetContents()
+		{
+			return contents;
+		}
+
+		const CHAR_INFO* GetContents() const
+		{
+			return contents;
+		}
+
+		bool Create(int width, int height)
+		{
+			if (width <= 0 || height <= 0) return false;
+
+			this->width = width;
+			this->height = height;
+
+			delete[] contents;
+			contents = new CHAR_INFO[width * height];
+
+			for (int i = 0; i < width * height; i++)
+			{
+				contents[i].Char.UnicodeChar = ' ';
+				contents[i].Attributes = BG_BLACK;
+			}
+
+			return true;
+		}
+
+		//Copies a block of another sprite to (x, y) of this one. Parts outside of either sprite are skipped.
+		void CopyBlock(int x, int y, const Sprite& sprite, int ox, int oy, int w, int h)
+		{
+			if (ox < 0) { x -= ox; w += ox; ox = 0; }
+			if (oy < 0) { y -= oy; h += oy; oy = 0; }
+			if (ox + w > sprite.width) w = sprite.width - ox;
+			if (oy + h > sprite.height) h = sprite.height - oy;
+
+			if (x < 0) { ox -= x; w += x; x = 0; }
+			if (y < 0) { oy -= y; h += y; y = 0; }
+			if (x + w > width) w = width - x;
+			if (y + h > height) h = height - y;
+
+			if (w <= 0 || h <= 0)
+				return;
+
+			for (int j = 0; j < h; j++)
+				memcpy(contents + width * (y + j) + x, sprite.contents + sprite.width * (oy + j) + ox, sizeof(CHAR_INFO) * w);
+		}
+
+		void Copy(const Sprite& sprite)
+		{
+			if (sprite.contents == nullptr)
+			{
+				delete[] contents;
+				width = 0;
+				height = 0;
+				contents = nullptr;
+				return;
+			}
+
+			//The buffer is only reallocated when the size changes
+			if (width != sprite.width || height != sprite.height || contents == nullptr)
+				Create(sprite.width, sprite.height);
+
+			memcpy(contents, sprite.contents, sizeof(CHAR_INFO) * width * height);
+		}
+
+		void SetCharacter(int x, int y, short character)
+		{
+			if (x < 0 || x >= width || y < 0 || y >= height) return;
+			contents[width * y + x].Char.UnicodeChar = character;
+		}
+
+		short GetCharacter(int x, int y)
+		{
+			if (x < 0 || x >= width || y < 0 || y >= height) return ' ';
+			return contents[width * y + x].Char.UnicodeChar;
+		}
+
+		const short GetCharacter(int x, int y) const
+		{
+			if (x < 0 || x >= width || y < 0 || y >= height) return ' ';
+			return contents[width * y + x].Char.UnicodeChar;
+		}
+
+		void SetColor(int x, int y, short color)
+		{
+			if (x < 0 || x >= width || y < 0 || y >= height) return;
+			contents[width * y + x].Attributes = color;
+		}
+
+		short GetColor(int x, int y)
+		{
+			if (x < 0 || x >= width || y < 0 || y >= height) return BG_BLACK;
+			return contents[width * y + x].Attributes;
+		}
+
+		const short GetColor(int x, int y) const
+		{
+			if (x < 0 || x >= width || y < 0 || y >= height) return BG_BLACK;
+			return contents[width * y + x].Attributes;
+		}
+
+		short SampleCharacter(float x, float y)
+		{
+			int sx = (int)(x * (float)width);
+			int sy = (int)(y * (float)height);
+
+			if (sx < 0)
+				sx = 0;
+			else if (sx >= width)
+				sx = width - 1;
+
+			if (sy < 0)
+				sy = 0;
+			else if (sy >= height)
+				sy = height - 1;
+
+			return contents[width * sy + sx].Char.UnicodeChar;
+		}
+
+		short SampleColor(float x, float y)
+		{
+			int sx = (int)(x * (float)width);
+			int sy = (int)(y * (float)height);
+
+			if (sx < 0)
+				sx = 0;
+			else if (sx >= width)
+				sx = width - 1;
+
+			if (sy < 0)
+				sy = 0;
+			else if (sy >= height)
+				sy = height - 1;
+
+			return contents[width * sy + sx].Attributes;
+		}
+
+		CHAR_INFO Sample(float x, float y) const
+		{
+			int sx = (int)(x * (float)width);
+			int sy = (int)(y * (float)height);
+
+			sx = sx < 0 ? 0 : (sx >= width ? width - 1 : sx);
+			sy = sy < 0 ? 0 : (sy >= height ? height - 1 : sy);
+
+			return contents[width * sy + sx];
+		}
+
+		//Samples count cells along a line, starting at (u, v) and moving by (du, dv) per cell, with the same coordinates
+		//and clamping as Sample(). Coordinates are stepped in 16.16 fixed point, so the loop has no float math.
+		void SampleSpan(CHAR_INFO *destination, int count, float u, float v, float du, float dv) const
+		{
+			if (contents == nullptr)
+				return;
+
+			//Far away coordinates are clamped first, so that stepping cannot overflow. The steps are bounded so that
+			//the whole span moves by at most the same limit, which is far outside of any sprite and clamps the same.
+			const double limit = (double)(1LL << 40);
+			const double stepLimit = limit / (double)max(count, 1);
+			long long x = (long long)max(min((double)u * width * 65536.0, limit), -limit);
+			long long y = (long long)max(min((double)v * height * 65536.0, limit), -limit);
+			long long stepX = (long long)max(min((double)du * width * 65536.0, stepLimit), -stepLimit);
+			long long stepY = (long long)max(min((double)dv * height * 65536.0, stepLimit), -stepLimit);
+
+			if (stepY == 0)
+			{
+				//Horizontal spans read a single row
+				long long sy = y >> 16;
+				const CHAR_INFO *row = contents + width * (sy < 0 ? 0 : (sy >= height ? height - 1 : sy));
+
+				for (int i = 0; i < count; i++, x += stepX)
+				{
+					long long sx = x >> 16;
+					destination[i] = row[sx < 0 ? 0 : (sx >= width ? width - 1 : sx)];
+				}
+				return;
+			}
+
+			for (int i = 0; i < count; i++, x += stepX, y += stepY)
+			{
+				long long sx = x >> 16;
+				long long sy = y >> 16;
+				sx = sx < 0 ? 0 : (sx >= width ? width - 1 : sx);
+				sy = sy < 0 ? 0 : (sy >= height ? height - 1 : sy);
+
+				destination[i] = contents[width * sy + sx];
+			}
+		}
+
+		//Sprite files start with a header, followed by the character plane and then the color plane.
+		//Either plane may be run-length encoded as pairs of 16-bit run lengths and values.
+		static const int fileVersion = 1;
+
+		enum FileFlags
+		{
+			FILE_RLE_CHARACTERS = 1,
+			FILE_RLE_COLORS = 2
+		};
+
+		struct FileHeader
+		{
+			char magic[4];
+			WORD version;
+			WORD flags;
+			int width;
+			int height;
+		};
+
+		bool Save(std::wstring fileName, bool compress = true)
+		{
+			std::vector<BYTE> encoded;
+			if (!Encode(encoded, compress)) return false;
+
+			FILE *file = nullptr;
+			if (_wfopen_s(&file, fileName.c_str(), L"wb") != 0) return false;
+
+			bool written = fwrite(encoded.data(), 1, encoded.size(), file) == encoded.size();
+			fclose(file);
+
+			return written;
+		}
+
+		//Maps the file instead of reading it, the contents are decoded straight from the view
+		bool Load(std::wstring fileName)
+		{
+			return MapFile(fileName, [this](const BYTE *bytes, size_t size) { return Load(bytes, size); });
+		}
+
+		//Decodes a sprite file that is stored in memory. Files without a header written by older versions are accepted as well.
+		//The sprite is left unchanged if the data is malformed.
+		bool Load(const void *data, size_t size)
+		{
+			const BYTE *bytes = (const BYTE*)data;
+
+			if (size < sizeof(FileHeader) || memcmp(bytes, "CGES", 4) != 0)
+				return LoadLegacy(bytes, size);
+
+			size_t offset = 0;
+			return Decode(bytes, size, offset);
+		}
+
+		//Sprite packs hold any number of sprite files back to back after a header with their count,
+		//so that a whole set of sprites is loaded from a single mapping of one file
+		struct PackHeader
+		{
+			char magic[4];
+			WORD version;
+			WORD reserved;
+			int count;
+		};
+
+		static bool SavePack(std::wstring fileName, const std::vector<Sprite> &sprites, bool compress = true)
+		{
+			PackHeader header = { { 'C', 'G', 'E', 'P' }, (WORD)fileVersion, 0, (int)sprites.size() };
+
+			std::vector<BYTE> encoded((const BYTE*)&header, (const BYTE*)&header + sizeof(PackHeader));
+			for (const Sprite &sprite : sprites)
+			{
+				if (!sprite.Encode(encoded, compress))
+					return false;
+			}
+
+			FILE *file = nullptr;
+			if (_wfopen_s(&file, fileName.c_str(), L"wb") != 0) return false;
+
+			bool written = fwrite(encoded.data(), 1, encoded.size(), file) == encoded.size();
+			fclose(file);
+
+			return written;
+		}
+
+		//Appends the sprites of the pack. Nothing is appended if the pack is malformed.
+		static bool LoadPack(std::wstring fileName, std::vector<Sprite> &sprites)
+		{
+			return MapFile(fileName, [&sprites](const BYTE *bytes, size_t size) { return LoadPack(bytes, size, sprites); });
+		}
+
+		static bool LoadPack(const void *data, size_t size, std::vector<Sprite> &sprites)
+		{
+			const BYTE *bytes = (const BYTE*)data;
+
+			PackHeader header;
+			if (size < sizeof(PackHeader)) return false;
+			memcpy(&header, bytes, sizeof(PackHeader));
+
+			//Every sprite takes at least a header, which bounds the count by the size of the data
+			if (memcmp(header.magic, "CGEP", 4) != 0 || header.version != fileVersion || header.count < 0 ||
+				(size_t)header.count > (size - sizeof(PackHeader)) / sizeof(FileHeader))
+				return false;
+
+			size_t first = sprites.size();
+			sprites.resize(first + header.count);
+
+			size_t offset = sizeof(PackHeader);
+			for (int i = 0; i < header.count; i++)
+			{
+				if (!sprites[first + i].Decode(bytes, size, offset))
+				{
+					sprites.resize(first);
+					return false;
+				}
+			}
+
+			return true;
+		}
+
+	private:
+		//Guards against sizes that would overflow when multiplied
+		static bool IsValidSize(int width, int height)
+		{
+			return width > 0 && height > 0 && width <= 0x8000 && height <= 0x8000;
+		}
+
+		//Maps the file and hands its contents to the decoder
+		template<typename Decoder>
+		static bool MapFile(const std::wstring &fileName, Decoder decode)
+		{
+			HANDLE file = CreateFile(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+			if (file == INVALID_HANDLE_VALUE) return false;
+
+			LARGE_INTEGER fileSize;
+			HANDLE mapping = NULL;
+			if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0)
+				mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+
+			CloseHandle(file);
+			if (mapping == NULL) return false;
+
+			const BYTE *view = (const BYTE*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+			CloseHandle(mapping);
+			if (view == nullptr) return false;
+
+			bool decoded = decode(view, (size_t)fileSize.QuadPart);
+			UnmapViewOfFile(view);
+
+			return decoded;
+		}
+
+		//Appends the header and both planes
+		bool Encode(std::vector<BYTE> &output, bool compress) const
+		{
+			if (contents == nullptr) return false;
+
+			FileHeader header;
+			memcpy(header.magic, "CGES", 4);
+			header.version = fileVersion;
+			header.flags = 0;
+			header.width = width;
+			header.height = height;
+
+			std::vector<BYTE> planes[2];
+			for (int plane = 0; plane < 2; plane++)
+			{
+				bool rle = compress && EncodePlane(plane == 1, true, planes[plane]);
+				if (rle)
+					header.flags |= (plane == 0) ? FILE_RLE_CHARACTERS : FILE_RLE_COLORS;
+				else
+					EncodePlane(plane == 1, false, planes[plane]);
+			}
+
+			const BYTE *headerBytes = (const BYTE*)&header;
+			output.insert(output.end(), headerBytes, headerBytes + sizeof(FileHeader));
+			for (auto &plane : planes)
+				output.insert(output.end(), plane.begin(), plane.end());
+
+			return true;
+		}
+
+		//Smallest number of bytes a plane of the given number of cells can be encoded in
+		static size_t GetMinimumPlaneSize(size_t cells, bool rle)
+		{
+			return rle ? (cells + 0xFFFE) / 0xFFFF * sizeof(WORD) * 2 : cells * sizeof(WORD);
+		}
+
+		//Decodes the sprite file at the offset and moves the offset past it
+		bool Decode(const BYTE *bytes, size_t size, size_t &offset)
+		{
+			FileHeader header;
+			if (size - offset < sizeof(FileHeader)) return false;
+			memcpy(&header, bytes + offset, sizeof(FileHeader));
+
+			if (memcmp(header.magic, "CGES", 4) != 0 || header.version != fileVersion || !IsValidSize(header.width, header.height))
+				return false;
+
+			size_t cells = (size_t)header.width * (size_t)header.height;
+			bool rle[2] = { (header.flags & FILE_RLE_CHARACTERS) != 0, (header.flags & FILE_RLE_COLORS) != 0 };
+
+			//Nothing is allocated for a size that the data couldn't possibly describe
+			size_t position = offset + sizeof(FileHeader);
+			if (size - position < GetMinimumPlaneSize(cells, rle[0]) + GetMinimumPlaneSize(cells, rle[1]))
+				return false;
+
+			//Both planes cover every cell exactly, so the new contents don't need to be initialized
+			CHAR_INFO *decoded = new CHAR_INFO[cells];
+			for (int plane = 0; plane < 2; plane++)
+			{
+				if (!DecodePlane(bytes, size, position, decoded, cells, plane == 1, rle[plane]))
+				{
+					delete[] decoded;
+					return false;
+				}
+			}
+
+			delete[] contents;
+			contents = decoded;
+			width = header.width;
+			height = header.height;
+			offset = position;
+
+			return true;
+		}
+
+		//Older files consist of the width, the height and the raw cells
+		bool LoadLegacy(const BYTE *bytes, size_t size)
+		{
+			int legacySize[2];
+			if (size < sizeof(legacySize)) return false;
+
+			memcpy(legacySize, bytes, sizeof(legacySize));
+			if (!IsValidSize(legacySize[0], legacySize[1]))
+				return false;
+
+			size_t cells = (size_t)legacySize[0] * (size_t)legacySize[1];
+			if (size - sizeof(legacySize) < cells * sizeof(CHAR_INFO))
+				return false;
+
+			Create(legacySize[0], legacySize[1]);
+			memcpy(contents, bytes + sizeof(legacySize), cells * sizeof(CHAR_INFO));
+
+			return true;
+		}
+
+		WORD GetPlaneValue(int index, bool colors) const
+		{
+			return colors ? contents[index].Attributes : contents[index].Char.UnicodeChar;
+		}
+
+		//Returns false if run-length encoding was requested but wouldn't make the plane any smaller
+		bool EncodePlane(bool colors, bool rle, std::vector<BYTE> &output) const
+		{
+			int cells = width * height;
+			output.clear();
+
+			if (!rle)
+			{
+				output.resize(cells * sizeof(WORD));
+				for (int i = 0; i < cells; i++)
+				{
+					WORD value = GetPlaneValue(i, colors);
+					memcpy(&output[i * sizeof(WORD)], &value, sizeof(WORD));
+				}
+				return true;
+			}
+
+			for (int i = 0; i < cells;)
+			{
+				WORD value = GetPlaneValue(i, colors);
+				WORD run[2] = { 1, value };
+
+				while (i + run[0] < cells && run[0] < 0xFFFF && GetPlaneValue(i + run[0], colors) == value)
+					run[0]++;
+
+				const BYTE *runBytes = (const BYTE*)run;
+				output.insert(output.end(), runBytes, runBytes + sizeof(run));
+
+				if (output.size() >= (size_t)cells * sizeof(WORD))
+					return false;
+
+				i += run[0];
+			}
+
+			return true;
+		}
+
+		static bool DecodePlane(const BYTE *bytes, size_t size, size_t &offset, CHAR_INFO *cells, size_t count, bool colors, bool rle)
+		{
+			auto setValue = [&](size_t index, WORD value)
+			{
+				if (colors)
+					cells[index].Attributes = value;
+				else
+					cells[index].Char.UnicodeChar = value;
+			};
+
+			if (!rle)
+			{
+				if (size - offset < count * sizeof(WORD))
+					return false;
+
+				for (size_t i = 0; i < count; i++)
+				{
+					WORD value;
+					memcpy(&value, bytes + offset + i * sizeof(WORD), sizeof(WORD));
+					setValue(i, value);
+				}
+
+				offset += count * sizeof(WORD);
+				return true;
+			}
+
+			for (size_t i = 0; i < count;)
+			{
+				WORD run[2];
+				if (size - offset < sizeof(run))
+					return false;
+
+				memcpy(run, bytes + offset, sizeof(run));
+				offset += sizeof(run);
+
+				//Runs must cover the plane exactly
+				if (run[0] == 0 || run[0] > count - i)
+					return false;
+
+				for (WORD k = 0; k < run[0]; k++)
+					setValue(i++, run[1]);
+			}
+
+			return true;
+		}
+
+	};
+
+	//Chain of ever smaller copies of a sprite, each half the size of the previous one, for sprites that are drawn much smaller
+	//than they are. Glyphs cannot be blended, so every cell of a level takes the most common cell of the 2x2 block below it.
+	class SpriteMipmap
+	{
+	private:
+		std::vector<Sprite> levels;
+
+	public:
+		SpriteMipmap() {}
+
+		SpriteMipmap(const Sprite& sprite)
+		{
+			Build(sprite);
+		}
+
+		void Build(const Sprite& sprite)
+		{
+			levels.clear();
+			if (sprite.GetContents() == nullptr)
+				return;
+
+			levels.push_back(sprite);
+
+			while (levels.back().GetWidth() > 1 || levels.back().GetHeight() > 1)
+			{
+				const Sprite &source = levels.back();
+				Sprite level((source.GetWidth() + 1) / 2, (source.GetHeight() + 1) / 2);
+
+				for (int y = 0; y < level.GetHeight(); y++)
+				{
+					for (int x = 0; x < level.GetWidth(); x++)
+						level.GetContents()[level.GetWidth() * y + x] = MostCommonCell(source, x * 2, y * 2);
+				}
+
+				levels.push_back(std::move(level));
+			}
+		}
+
+		int GetLevelCount() const
+		{
+			return (int)levels.size();
+		}
+
+		Sprite& GetLevel(int level)
+		{
+			return levels[level];
+		}
+
+		//Picks the level at which one step of (du, dv) moves by about one cell
+		int SelectLevel(float du, float dv) const
+		{
+			if (levels.empty())
+				return 0;
+
+			float cells = max(fabsf(du) * (float)levels[0].GetWidth(), fabsf(dv) * (float)levels[0].GetHeight());
+
+			int level = 0;
+			while (cells >= 2.0f && level + 1 < (int)levels.size())
+			{
+				cells *= 0.5f;
+				level++;
+			}
+			return level;
+		}
+
+	private:
+		static CHAR_INFO MostCommonCell(const Sprite& sprite, int x, int y)
+		{
+			//Blocks at the right and bottom edges of sprites with odd sizes repeat their last row or column
+			const CHAR_INFO *contents = sprite.GetContents();
+			int x1 = min(x + 1, sprite.GetWidth() - 1);
+			int y1 = min(y + 1, sprite.GetHeight() - 1);
+
+			CHAR_INFO cells[4] =
+			{
+				contents[sprite.GetWidth() * y + x], contents[sprite.GetWidth() * y + x1],
+				contents[sprite.GetWidth() * y1 + x], contents[sprite.GetWidth() * y1 + x1]
+			};
+
+			//Ties go to the first cell, i.e. the top left one
+			int best = 0;
+			int bestCount = 0;
+			for (int i = 0; i < 4; i++)
+			{
+				int count = 0;
+				for (int j = 0; j < 4; j++)
+				{
+					if (cells[i].Char.UnicodeChar == cells[j].Char.UnicodeChar && cells[i].Attributes == cells[j].Attributes)
+						count++;
+				}
+
+				if (count > bestCount)
+				{
+					best = i;
+					bestCount = count;
+				}
+			}
+
+			return cells[best];
+		}
+	};
+
+	//Region of a sprite, usually one handed out by a SpriteAtlas
+	struct SpriteView
+	{
+		Sprite *sprite = nullptr;
+		int x = 0;
+		int y = 0;
+		int width = 0;
+		int height = 0;
+
+		bool IsValid() const
+		{
+			return sprite != nullptr;
+		}
+	};
+
+	//Packs many small sprites into the rows ("shelves") of one large sprite, so they share a single allocation and stay
+	//close together in memory. The atlas must outlive the views it hands out.
+	class SpriteAtlas
+	{
+	private:
+		struct Shelf
+		{
+			int y;
+			int height;
+			int used;
+		};
+
+		Sprite sheet;
+		std::vector<Shelf> shelves;
+
+	public:
+		SpriteAtlas(int width, int height) : sheet(width, height) {}
+
+		SpriteAtlas(const SpriteAtlas&) = delete;
+		SpriteAtlas& operator=(const SpriteAtlas&) = delete;
+
+		Sprite& GetSprite()
+		{
+			return sheet;
+		}
+
+		//Reserves a w*h region; returns an invalid view if the atlas is full
+		SpriteView Allocate(int w, int h)
+		{
+			SpriteView view;
+			if (w <= 0 || h <= 0 || w > sheet.GetWidth() || h > sheet.GetHeight())
+				return view;
+
+			//Pick the lowest shelf that still has room, so that little height is wasted
+			Shelf *best = nullptr;
+			for (auto &shelf : shelves)
+			{
+				if (shelf.height >= h && shelf.used + w <= sheet.GetWidth() && (best == nullptr || shelf.height < best->height))
+					best = &shelf;
+			}
+
+			if (best == nullptr)
+			{
+				int top = shelves.empty() ? 0 : shelves.back().y + shelves.back().height;
+				if (top + h > sheet.GetHeight())
+					return view;
+
+				shelves.push_back({ top, h, 0 });
+				best = &shelves.back();
+			}
+
+			view.sprite = &sheet;
+			view.x = best->used;
+			view.y = best->y;
+			view.width = w;
+			view.height = h;
+
+			best->used += w;
+			return view;
+		}
+
+		//Copies the sprite into the atlas
+		SpriteView Add(const Sprite &sprite)
+		{
+			SpriteView view = Allocate(sprite.GetWidth(), sprite.GetHeight());
+			if (view.IsValid())
+				sheet.CopyBlock(view.x, view.y, sprite, 0, 0, view.width, view.height);
+
+			return view;
+		}
+
+		SpriteView Add(std::wstring fileName)
+		{
+			Sprite sprite;
+			if (!sprite.Load(fileName))
+				return SpriteView();
+
+			return Add(sprite);
+		}
+
+		//Invalidates every view handed out so far
+		void Clear()
+		{
+			shelves.clear();
+			sheet.Create(sheet.GetWidth(), sheet.GetHeight());
+		}
+	};
+
+	//Sprite whose characters and colors are kept in two separate planes. Passes that only touch one of them, like
+	//recoloring, read and write half as much memory and vectorize cleanly. The planes are interleaved into cells
+	//only when the sprite is drawn.
+	class PlanarSprite
+	{
+	private:
+		int width = 0;
+		int height = 0;
+
+		std::vector<WORD> glyphs;
+		std::vector<WORD> colors;
+
+	public:
+		PlanarSprite() {}
+
+		PlanarSprite(int width, int height)
+		{
+			Create(width, height);
+		}
+
+		explicit PlanarSprite(const Sprite& sprite)
+		{
+			FromSprite(sprite);
+		}
+
+		int GetWidth() const
+		{
+			return width;
+		}
+
+		int GetHeight() const
+		{
+			return height;
+		}
+
+		//Both planes are stored row by row
+		WORD* GetGlyphs()
+		{
+			return glyphs.data();
+		}
+
+		const WORD* GetGlyphs() const
+		{
+			return glyphs.data();
+		}
+
+		WORD* GetColors()
+		{
+			return colors.data();
+		}
+
+		const WORD* GetColors() const
+		{
+			return colors.data();
+		}
+
+		bool Create(int width, int height)
+		{
+			if (width <= 0 || height <= 0) return false;
+
+			this->width = width;
+			this->height = height;
+
+			glyphs.assign(width * height, ' ');
+			colors.assign(width * height, BG_BLACK);
+
+			return true;
+		}
+
+		void FromSprite(const Sprite& sprite)
+		{
+			if (!Create(sprite.GetWidth(), sprite.GetHeight()))
+			{
+				width = 0;
+				height = 0;
+				glyphs.clear();
+				colors.clear();
+				return;
+			}
+
+			const CHAR_INFO *cells = sprite.GetContents();
+			for (int i = 0; i < width * height; i++)
+			{
+				glyphs[i] = cells[i].Char.UnicodeChar;
+				colors[i] = cells[i].Attributes;
+			}
+		}
+
+		void ToSprite(Sprite& sprite) const
+		{
+			if (!sprite.Create(width, height))
+				return;
+
+			InterleaveSpan(sprite.GetContents(), glyphs.data(), colors.data(), width * height);
+		}
+
+		void SetCharacter(int x, int y, short character)
+		{
+			if (x < 0 || x >= width || y < 0 || y >= height) return;
+			glyphs[width * y + x] = character;
+		}
+
+		short GetCharacter(int x, int y) const
+		{
+			if (x < 0 || x >= width || y < 0 || y >= height) return ' ';
+			return glyphs[width * y + x];
+		}
+
+		void SetColor(int x, int y, short color)
+		{
+			if (x < 0 || x >= width || y < 0 || y >= height) return;
+			colors[width * y + x] = color;
+		}
+
+		short GetColor(int x, int y) const
+		{
+			if (x < 0 || x >= width || y < 0 || y >= height) return BG_BLACK;
+			return colors[width * y + x];
+		}
+
+		short SampleCharacter(float x, float y) const
+		{
+			return glyphs[SampleIndex(x, y)];
+		}
+
+		short SampleColor(float x, float y) const
+		{
+			return colors[SampleIndex(x, y)];
+		}
+
+		void FillCharacter(short character)
+		{
+			std::fill(glyphs.begin(), glyphs.end(), (WORD)character);
+		}
+
+		void FillColor(short color)
+		{
+			std::fill(colors.begin(), colors.end(), (WORD)color);
+		}
+
+		//Replaces every cell of one color with another
+		void Recolor(short from, short to)
+		{
+			WORD *plane = colors.data();
+			int count = width * height;
+			int i = 0;
+
+#ifdef CGE_SSE2
+			const __m128i fromColor = _mm_set1_epi16(from);
+			const __m128i toColor = _mm_set1_epi16(to);
+
+			for (; i + 8 <= count; i += 8)
+			{
+				__m128i current = _mm_loadu_si128((const __m128i*)(plane + i));
+				__m128i match = _mm_cmpeq_epi16(current, fromColor);
+				_mm_storeu_si128((__m128i*)(plane + i), _mm_or_si128(_mm_and_si128(match, toColor), _mm_andnot_si128(match, current)));
+			}
+#endif
+
+			for (; i < count; i++)
+			{
+				if (plane[i] == (WORD)from)
+					plane[i] = to;
+			}
+		}
+
+		//Overwrites the bits of every color selected by the mask, e.g. SetColorBits(0x0F, FG_RED) changes only the foreground
+		void SetColorBits(WORD mask, WORD value)
+		{
+			WORD *plane = colors.data();
+			int count = width * height;
+			int i = 0;
+
+#ifdef CGE_SSE2
+			const __m128i keep = _mm_set1_epi16((short)~mask);
+			const __m128i bits = _mm_set1_epi16((short)(value & mask));
+
+			for (; i + 8 <= count; i += 8)
+			{
+				__m128i current = _mm_loadu_si128((const __m128i*)(plane + i));
+				_mm_storeu_si128((__m128i*)(plane + i), _mm_or_si128(_mm_and_si128(current, keep), bits));
+			}
+#endif
+
+			for (; i < count; i++)
+				plane[i] = (plane[i] & ~mask) | (value & mask);
+		}
+
+	private:
+		int SampleIndex(float x, float y) const
+		{
+			int sx = (int)(x * (float)width);
+			int sy = (int)(y * (float)height);
+
+			if (sx < 0)
+				sx = 0;
+			else if (sx >= width)
+				sx = width - 1;
+
+			if (sy < 0)
+				sy = 0;
+			else if (sy >= height)
+				sy = height - 1;
+
+			return width * sy + sx;
+		}
+	};
+
+	//Text rendered into a sprite once, for labels that rarely change. Lines are separated with '\n' and padded with spaces
+	//to the longest one, so drawing the label is a single copy per line.
+	class TextLabel
+	{
+	private:
+		Sprite sprite;
+		std::wstring text;
+		short color = 0;
+
+	public:
+		TextLabel() {}
+
+		TextLabel(std::wstring_view text, short bgColor = DEFAULT_COLOR, short fgColor = FG_BLACK)
+		{
+			SetText(text, bgColor, fgColor);
+		}
+
+		//Renders the text again only if it or its color changed, returns whether it did
+		bool SetText(std::wstring_view newText, short bgColor = DEFAULT_COLOR, short fgColor = FG_BLACK)
+		{
+			short newColor = bgColor | fgColor;
+			if (sprite.GetContents() != nullptr && newColor == color && newText == text)
+				return false;
+
+			text.assign(newText.data(), newText.size());
+			color = newColor;
+
+			int width = 0;
+			int height = 1;
+			int length = 0;
+			for (wchar_t c : text)
+			{
+				if (c == L'\n')
+				{
+					height++;
+					length = 0;
+				}
+				else if (++length > width)
+					width = length;
+			}
+
+			if (width == 0)
+			{
+				sprite = Sprite();
+				return true;
+			}
+
+			if (sprite.GetWidth() != width || sprite.GetHeight() != height)
+				sprite.Create(width, height);
+
+			CHAR_INFO blank;
+			blank.Char.UnicodeChar = L' ';
+			blank.Attributes = color;
+
+			CHAR_INFO *cells = sprite.GetContents();
+			std::fill(cells, cells + width * height, blank);
+
+			int x = 0;
+			int y = 0;
+			for (wchar_t c : text)
+			{
+				if (c == L'\n')
+				{
+					x = 0;
+					y++;
+					continue;
+				}
+
+				cells[width * y + x++].Char.UnicodeChar = c;
+			}
+
+			return true;
+		}
+
+		std::wstring_view GetText() const
+		{
+			return text;
+		}
+
+		Sprite& GetSprite()
+		{
+			return sprite;
+		}
+	};
+
+public:
+	//Vertex of a mesh in cells, where cell (x, y) covers [x, x + 1) horizontally and [y, y + 1) vertically.
+	//The intensity (0 to 1) picks the entry of the ramp when a mesh is shaded.
+	struct MeshVertex
+	{
+		float x, y;
+		float intensity;
+	};
+
+private:
+	//Triangle vertices in fixed point with subpixelBits fractional bits
+	struct FixedVertex
+	{
+		long long x, y;
+		float intensity;
+	};
+
+	static const int subpixelBits = 4;
+	static const int subpixelScale = 1 << subpixelBits;
+
+	//Inclusive bounds that primitives are clipped to: the screen for immediate drawing, or a band of it when a draw list is split between threads
+	struct ClipRect
+	{
+		int left, top, right, bottom;
+	};
+
+	ClipRect ScreenClip()
+	{
+		return { 0, 0, screenWidth - 1, screenHeight - 1 };
+	}
+
+protected:
+	void Draw(int index, short character = DEFAULT_CHAR, short color = DEFAULT_COLOR)
+	{
+		if (index >= 0 && index < screenWidth * screenHeight)
+		{
+			screen[index].Char.UnicodeChar = character;
+			screen[index].Attributes = color;
+		}
+	}
+
+	void DrawPoint(int x, int y, short character = DEFAULT_CHAR, short color = DEFAULT_COLOR)
+	{
+		if (x >= 0 && x < screenWidth && y >= 0 && y < screenHeight)
+		{
+			int index = screenWidth * y + x;
+			screen[index].Char.UnicodeChar = character;
+			screen[index].Attributes = color;
+		}
+	}
+
+	void DrawLine(int x0, int y0, int x1, int y1, short character = DEFAULT_CHAR, short color = DEFAULT_COLOR)
+	{
+		RasterLine(x0, y0, x1, y1, character, color, ScreenClip());
+	}
+
+	void DrawTriangle(int x0, int y0, int x1, int y1, int x2, int y2, short character = DEFAULT_CHAR, short color = DEFAULT_COLOR)
+	{
+		RasterTriangle(x0, y0, x1, y1, x2, y2, character, color, ScreenClip());
+	}
+
+	//Fills the cells whose centres lie inside the triangle. Cells on an edge are only filled if it is a top or a left edge,
+	//so triangles that share an edge never draw over each other. Triangles without an area draw nothing.
+	void DrawFilledTriangle(int x0, int y0, int x1, int y1, int x2, int y2, short character = DEFAULT_CHAR, short color = DEFAULT_COLOR)
+	{
+		RasterFilledTriangle(x0, y0, x1, y1, x2, y2, character, color, ScreenClip());
+	}
+
+	//Fills triangleCount triangles, each given by three consecutive indices into the vertices, with the same fill rule as DrawFilledTriangle()
+	void DrawMesh(const MeshVertex *vertices, const int *indices, int triangleCount, short character = PIXEL_SOLID, short color = FG_WHITE)
+	{
+		CHAR_INFO cell = MakeCell(character, color);
+		RasterMesh(vertices, indices, triangleCount, &cell, 1);
+	}
+
+	//Shades the mesh by interpolating the intensities of the vertices across every triangle and picking the matching entry of the ramp,
+	//e.g. characters from PIXEL_QUARTER to PIXEL_SOLID, or a range of colors
+	void DrawMesh(const MeshVertex *vertices, const int *indices, int triangleCount, const CHAR_INFO *ramp, int rampSize)
+	{
+		if (rampSize > 0)
+			RasterMesh(vertices, indices, triangleCount, ramp, rampSize);
+	}
+
+	void DrawWireframe(const MeshVertex *vertices, const int *indices, int triangleCount, short character = PIXEL_SOLID, short color = FG_WHITE)
+	{
+		const ClipRect clip = ScreenClip();
+
+		for (int i = 0; i < triangleCount; i++)
+		{
+			const MeshVertex &a = vertices[indices[3 * i]];
+			const MeshVertex &b = vertices[indices[3 * i + 1]];
+			const MeshVertex &c = vertices[indices[3 * i + 2]];
+
+			RasterTriangle((int)floorf(a.x), (int)floorf(a.y), (int)floorf(b.x), (int)floorf(b.y), (int)floorf(c.x), (int)floorf(c.y), character, color, clip);
+		}
+	}
+
+private:
+	//Seeds of FloodFill, kept between calls so that filling doesn't allocate
+	std::vector<int> floodFillStack;
+
+	static CHAR_INFO MakeCell(short character, short color)
+	{
+		CHAR_INFO cell;
+		cell.Char.UnicodeChar = character;
+		cell.Attributes = color;
+		return cell;
+	}
+
+	//The cell as a 32-bit value, character in the low and attributes in the high half
+	static int PackCell(CHAR_INFO cell)
+	{
+		int packed;
+		memcpy(&packed, &cell, sizeof(CHAR_INFO));
+		return packed;
+	}
+
+	void RasterLine(int x0, int y0, int x1, int y1, short character, short color, const ClipRect &clip)
+	{
+		//Lines that lie within the clip rectangle as a whole skip the test for every point
+		bool inside = min(x0, x1) >= clip.left && max(x0, x1) <= clip.right && min(y0, y1) >= clip.top && max(y0, y1) <= clip.bottom;
+
+		int dx = abs(x1 - x0);
+		int sx = (x0 < x1) ? 1 : -1;
+		int dy = -abs(y1 - y0);
+		int sy = (y0 < y1) ? 1 : -1;
+		int error = dx + dy;
+		while (true)
+		{
+			if (inside || (x0 >= clip.left && x0 <= clip.right && y0 >= clip.top && y0 <= clip.bottom))
+			{
+				int index = screenWidth * y0 + x0;
+				screen[index].Char.UnicodeChar = character;
+				screen[index].Attributes = color;
+			}
+			if (x0 == x1 && y0 == y1)
+				break;
+			int e2 = error * 2;
+			if (e2 >= dy)
+			{
+				error += dy;
+				x0 += sx;
+			}
+			if (e2 <= dx)
+			{
+				error += dx;
+				y0 += sy;
+			}
+		}
+	}
+
+	void RasterTriangle(int x0, int y0, int x1, int y1, int x2, int y2, short character, short color, const ClipRect &clip)
+	{
+		RasterLine(x0, y0, x1, y1, character, color, clip);
+		RasterLine(x1, y1, x2, y2, character, color, clip);
+		RasterLine(x2, y2, x0, y0, character, color, clip);
+	}
+
+	void RasterFilledTriangle(int x0, int y0, int x1, int y1, int x2, int y2, short character, short color, const ClipRect &clip)
+	{
+		FixedVertex a = { ToFixed(x0), ToFixed(y0), 0.0f };
+		FixedVertex b = { ToFixed(x1), ToFixed(y1), 0.0f };
+		FixedVertex c = { ToFixed(x2), ToFixed(y2), 0.0f };
+
+		CHAR_INFO cell = MakeCell(character, color);
+		RasterTriangleFixed(a, b, c, &cell, 1, clip);
+	}
+
+	void RasterMesh(const MeshVertex *vertices, const int *indices, int triangleCount, const CHAR_INFO *ramp, int rampSize)
+	{
+		const ClipRect clip = ScreenClip();
+
+		for (int i = 0; i < triangleCount; i++)
+		{
+			RasterTriangleFixed(ToFixed(vertices[indices[3 * i]]), ToFixed(vertices[indices[3 * i + 1]]), ToFixed(vertices[indices[3 * i + 2]]), ramp, rampSize, clip);
+		}
+	}
+
+	static FixedVertex ToFixed(const MeshVertex &vertex)
+	{
+		//Only vertices beyond the range of integer coordinates are clamped, which is needed to convert them at all
+		const double limit = 2147483648.0 * subpixelScale;
+		double x = max(min((double)vertex.x * subpixelScale, limit), -limit);
+		double y = max(min((double)vertex.y * subpixelScale, limit), -limit);
+
+		return { (long long)floor(x + 0.5), (long long)floor(y + 0.5), vertex.intensity };
+	}
+
+	//Integer coordinates refer to the centres of the cells
+	static long long ToFixed(int coordinate)
+	{
+		return (long long)coordinate * subpixelScale + subpixelScale / 2;
+	}
+
+	//Returns a * b - c * d for factors of up to 2^37, exact whenever the result fits into 62 bits and saturated to 2^62
+	//with the right sign otherwise. Saturated edge functions keep their sign across any clip rectangle, so far away
+	//vertices are rasterized exactly instead of being moved.
+	static long long CrossProduct(long long a, long long b, long long c, long long d)
+	{
+		const long long saturated = 1LL << 62;
+		double estimate = (double)a * (double)b - (double)c * (double)d;
+		if (estimate >= (double)saturated)
+			return saturated;
+		if (estimate <= -(double)saturated)
+			return -saturated;
+
+		//The products may wrap around, but their difference fits and comes out exact
+		return (long long)((unsigned long long)a * (unsigned long long)b - (unsigned long long)c * (unsigned long long)d);
+	}
+
+	static long long FloorDivide(long long a, long long b)
+	{
+		long long quotient = a / b;
+		if (a % b != 0 && (a < 0) != (b < 0))
+			quotient--;
+		return quotient;
+	}
+
+	//Edge function of a triangle edge, non-negative for the cells that are on the inner side of it
+	struct TriangleEdge
+	{
+		long long value;
+		long long stepX;
+		long long stepY;
+
+		//Not saturated, for interpolating the intensity
+		double weight;
+	};
+
+	static TriangleEdge SetupEdge(const FixedVertex &from, const FixedVertex &to, long long sampleX, long long sampleY)
+	{
+		long long dx = to.x - from.x;
+		long long dy = to.y - from.y;
+
+		//Cells exactly on the edge belong to the triangle only for top edges (horizontal, interior below) and left edges
+		bool topLeft = dy < 0 || (dy == 0 && dx > 0);
+
+		TriangleEdge edge;
+		edge.value = CrossProduct(dx, sampleY - from.y, dy, sampleX - from.x) - (topLeft ? 0 : 1);
+		edge.stepX = -dy * subpixelScale;
+		edge.stepY = dx * subpixelScale;
+		edge.weight = (double)dx * (double)(sampleY - from.y) - (double)dy * (double)(sampleX - from.x) - (topLeft ? 0 : 1);
+		return edge;
+	}
+
+	//Rasterizes the triangle row by row, solving the three edge functions for the span of covered cells, so the inner loop only fills.
+	//A ramp of one entry fills the triangle with it, longer ramps are indexed by the interpolated intensity.
+	void RasterTriangleFixed(FixedVertex a, FixedVertex b, FixedVertex c, const CHAR_INFO *ramp, int rampSize, const ClipRect &clip)
+	{
+		long long area = CrossProduct(b.x - a.x, c.y - a.y, b.y - a.y, c.x - a.x);
+		if (area == 0)
+			return;
+
+		//Edge functions are positive inside for one winding only
+		if (area < 0)
+			std::swap(b, c);
+
+		//Bounding box of the cells whose centres may be covered, clipped
+		const int half = subpixelScale / 2;
+		long long left = FloorDivide(min(a.x, min(b.x, c.x)) - half + subpixelScale - 1, subpixelScale);
+		long long top = FloorDivide(min(a.y, min(b.y, c.y)) - half + subpixelScale - 1, subpixelScale);
+		long long right = FloorDivide(max(a.x, max(b.x, c.x)) - half, subpixelScale);
+		long long bottom = FloorDivide(max(a.y, max(b.y, c.y)) - half, subpixelScale);
+
+		int minX = (int)max(left, (long long)clip.left);
+		int minY = (int)max(top, (long long)clip.top);
+		int maxX = (int)min(right, (long long)clip.right);
+		int maxY = (int)min(bottom, (long long)clip.bottom);
+
+		if (minX > maxX || minY > maxY)
+			return;
+
+		long long sampleX = (long long)minX * subpixelScale + half;
+		long long sampleY = (long long)minY * subpixelScale + half;
+
+		//Each edge function is the weight of the opposite vertex
+		TriangleEdge edges[3] =
+		{
+			SetupEdge(b, c, sampleX, sampleY),
+			SetupEdge(c, a, sampleX, sampleY),
+			SetupEdge(a, b, sampleX, sampleY)
+		};
+
+		bool shaded = rampSize > 1;
+		float intensity = 0.0f;
+		float intensityStepX = 0.0f;
+		float intensityStepY = 0.0f;
+
+		if (shaded)
+		{
+			double exactArea = (double)(b.x - a.x) * (double)(c.y - a.y) - (double)(b.y - a.y) * (double)(c.x - a.x);
+			float scale = (float)rampSize / (float)fabs(exactArea);
+			intensity = ((float)edges[0].weight * a.intensity + (float)edges[1].weight * b.intensity + (float)edges[2].weight * c.intensity) * scale;
+			intensityStepX = ((float)edges[0].stepX * a.intensity + (float)edges[1].stepX * b.intensity + (float)edges[2].stepX * c.intensity) * scale;
+			intensityStepY = ((float)edges[0].stepY * a.intensity + (float)edges[1].stepY * b.intensity + (float)edges[2].stepY * c.intensity) * scale;
+		}
+
+		for (int y = minY; y <= maxY; y++)
+		{
+			//Cells first..last (relative to minX) satisfy value + stepX * k >= 0 for every edge
+			long long first = 0;
+			long long last = maxX - minX;
+
+			for (const TriangleEdge &edge : edges)
+			{
+				if (edge.stepX > 0)
+				{
+					long long k = FloorDivide(-edge.value + edge.stepX - 1, edge.stepX);
+					if (k > first)
+						first = k;
+				}
+				else if (edge.stepX < 0)
+				{
+					long long k = FloorDivide(edge.value, -edge.stepX);
+					if (k < last)
+						last = k;
+				}
+				else if (edge.value < 0)
+					last = -1;
+			}
+
+			if (first <= last)
+			{
+				CHAR_INFO *row = screen + screenWidth * y + minX;
+
+				if (!shaded)
+					FillSpan(row + first, (int)(last - first + 1), ramp[0]);
+				else
+				{
+					for (long long k = first; k <= last; k++)
+					{
+						int index = (int)(intensity + intensityStepX * (float)k);
+						row[k] = ramp[index < 0 ? 0 : (index >= rampSize ? rampSize - 1 : index)];
+					}
+				}
+			}
+
+			for (TriangleEdge &edge : edges)
+				edge.value += edge.stepY;
+			intensity += intensityStepY;
+		}
+	}
+
+	void RasterRectangle(int x0, int y0, int x1, int y1, short character, short color, const ClipRect &clip)
+	{
+		RasterLine(x0, y0, x1, y0, character, color, clip);
+		RasterLine(x0, y1, x1, y1, character, color, clip);
+		RasterLine(x0, y0, x0, y1, character, color, clip);
+		RasterLine(x1, y0, x1, y1, character, color, clip);
+	}
+
+	void RasterFilledRectangle(int x0, int y0, int x1, int y1, short character, short color, const ClipRect &clip)
+	{
+		if (y1 < y0)
+		{
+			std::swap(y1, y0);
+			std::swap(x1, x0);
+		}
+		if (y0 < clip.top)
+			y0 = clip.top;
+		if (y1 > clip.bottom)
+			y1 = clip.bottom;
+
+		for (int y = y0; y <= y1; y++)
+		{
+			DrawSpan(x0, x1, y, character, color, clip);
+		}
+	}
+
+	void RasterCircle(int cx, int cy, int r, short character, short color, const ClipRect &clip)
+	{
+		int x = r;
+		int y = 0;
+		int sx = 1 - (2 * r);
+		int sy = 1;
+		int error = 0;
+		while (x >= y)
+		{
+			PlotPoint(cx + x, cy + y, character, color, clip); //Octant 1
+			PlotPoint(cx - x, cy + y, character, color, clip); //Octant 4
+			PlotPoint(cx - x, cy - y, character, color, clip); //Octant 5
+			PlotPoint(cx + x, cy - y, character, color, clip); //Octant 8
+			PlotPoint(cx + y, cy + x, character, color, clip); //Octant 2
+			PlotPoint(cx - y, cy + x, character, color, clip); //Octant 3
+			PlotPoint(cx - y, cy - x, character, color, clip); //Octant 6
+			PlotPoint(cx + y, cy - x, character, color, clip); //Octant 7
+
+			y++;
+			error += sy;
+			sy += 2;
+			if (2 * error + sx > 0)
+			{
+				x--;
+				error += sx;
+				sx += 2;
+			}
+		}
+	}
+
+	void RasterFilledCircle(int cx, int cy, int r, short character, short color, const ClipRect &clip)
+	{
+		int x = r;
+		int y = 0;
+		int sx = 1 - (2 * r);
+		int sy = 1;
+		int error = 0;
+		while (x >= y)
+		{
+			DrawSpan(cx - x, cx + x, cy + y, character, color, clip);	//Octants 1 and 4
+			DrawSpan(cx - x, cx + x, cy - y, character, color, clip);	//Octants 5 and 8
+			DrawSpan(cx - y, cx + y, cy + x, character, color, clip);	//Octants 2 and 3
+			DrawSpan(cx - y, cx + y, cy - x, character, color, clip);	//Octants 6 and 7
+
+			y++;
+			error += sy;
+			sy += 2;
+			if (2 * error + sx > 0)
+			{
+				x--;
+				error += sx;
+				sx += 2;
+			}
+		}
+	}
+
+	void PlotPoint(int x, int y, short character, short color, const ClipRect &clip)
+	{
+		if (x >= clip.left && x <= clip.right && y >= clip.top && y <= clip.bottom)
+		{
+			int index = screenWidth * y + x;
+			screen[index].Char.UnicodeChar = character;
+			screen[index].Attributes = color;
+		}
+	}
+
+	//Fills the cells from x0 to x1 (inclusive) of row y, clipped to the rectangle
+	void DrawSpan(int x0, int x1, int y, short character, short color, const ClipRect &clip)
+	{
+		if (y < clip.top || y > clip.bottom)
+			return;
+
+		if (x1 < x0)
+			std::swap(x0, x1);
+
+		if (x0 < clip.left)
+			x0 = clip.left;
+		if (x1 > clip.right)
+			x1 = clip.right;
+
+		if (x0 <= x1)
+			FillSpan(screen + screenWidth * y + x0, x1 - x0 + 1, MakeCell(character, color));
+	}
+
+	typedef void (*SpanFillFunction)(CHAR_INFO *destination, int count, CHAR_INFO value);
+
+	static void FillSpan(CHAR_INFO *destination, int count, CHAR_INFO value)
+	{
+		//The best kernel for the processor is selected once
+		static const SpanFillFunction fillSpan = SelectSpanFill();
+		fillSpan(destination, count, value);
+	}
+
+	static SpanFillFunction SelectSpanFill()
+	{
+#ifdef CGE_SSE2
+		if (IsAVX2Supported())
+			return FillSpanAVX2;
+
+		return FillSpanSSE2;
+#else
+		return FillSpanScalar;
+#endif
+	}
+
+	static void FillSpanScalar(CHAR_INFO *destination, int count, CHAR_INFO value)
+	{
+		for (int i = 0; i < count; i++)
+			destination[i] = value;
+	}
+
+#ifdef CGE_SSE2
+	static bool IsAVX2Supported()
+	{
+#ifdef _MSC_VER
+		int info[4];
+		__cpuid(info, 0);
+		if (info[0] < 7)
+			return false;
+
+		//The processor has to support AVX and the OS has to save the YMM registers
+		__cpuid(info, 1);
+		bool osxsave = (info[2] & (1 << 27)) != 0;
+		bool avx = (info[2] & (1 << 28)) != 0;
+		if (!osxsave || !avx || (_xgetbv(0) & 0x6) != 0x6)
+			return false;
+
+		__cpuidex(info, 7, 0);
+		return (info[1] & (1 << 5)) != 0;
+#else
+		return __builtin_cpu_supports("avx2");
+#endif
+	}
+
+	static void FillSpanSSE2(CHAR_INFO *destination, int count, CHAR_INFO value)
+	{
+		const __m128i cells = _mm_set1_epi32(PackCell(value));
+
+		int i = 0;
+		for (; i + 8 <= count; i += 8)
+		{
+			_mm_storeu_si128((__m128i*)(destination + i), cells);
+			_mm_storeu_si128((__m128i*)(destination + i + 4), cells);
+		}
+		for (; i + 4 <= count; i += 4)
+			_mm_storeu_si128((__m128i*)(destination + i), cells);
+		for (; i < count; i++)
+			destination[i] = value;
+	}
+
+	CGE_TARGET_AVX2 static void FillSpanAVX2(CHAR_INFO *destination, int count, CHAR_INFO value)
+	{
+		const __m256i cells = _mm256_set1_epi32(PackCell(value));
+
+		int i = 0;
+		for (; i + 16 <= count; i += 16)
+		{
+			_mm256_storeu_si256((__m256i*)(destination + i), cells);
+			_mm256_storeu_si256((__m256i*)(destination + i + 8), cells);
+		}
+		for (; i + 8 <= count; i += 8)
+			_mm256_storeu_si256((__m256i*)(destination + i), cells);
+		for (; i < count; i++)
+			destination[i] = value;
+	}
+#endif
+
+protected:
+	void DrawRectangle(int x0, int y0, int x1, int y1, short character = DEFAULT_CHAR, short color = DEFAULT_COLOR)
+	{
+		RasterRectangle(x0, y0, x1, y1, character, color, ScreenClip());
+	}
+
+	void DrawFilledRectangle(int x0, int y0, int x1, int y1, short character = DEFAULT_CHAR, short color = DEFAULT_COLOR)
+	{
+		RasterFilledRectangle(x0, y0, x1, y1, character, color, ScreenClip());
+	}
+
+	void DrawCircle(int cx, int cy, int r, short character = DEFAULT_CHAR, short color = DEFAULT_COLOR)
+	{
+		RasterCircle(cx, cy, r, character, color, ScreenClip());
+	}
+
+	void DrawFilledCircle(int cx, int cy, int r, short character = DEFAULT_CHAR, short color = DEFAULT_COLOR)
+	{
+		RasterFilledCircle(cx, cy, r, character, color, ScreenClip());
+	}
+
+	void DrawSprite(int x, int y, Sprite& sprite)
+	{
+		BlitSprite(x, y, sprite, 0, 0, sprite.GetWidth(), sprite.GetHeight());
+	}
+
+	void DrawSpriteAlpha(int x, int y, Sprite& sprite, short transparencyCol)
+	{
+		BlitSpriteAlpha(x, y, sprite, 0, 0, sprite.GetWidth(), sprite.GetHeight(), transparencyCol);
+	}
+
+	void DrawPartialSprite(int x, int y, Sprite& sprite, int ox, int oy, int w, int h)
+	{
+		BlitSprite(x, y, sprite, ox, oy, w, h);
+	}
+
+	void DrawPartialSpriteAlpha(int x, int y, Sprite& sprite, int ox, int oy, int w, int h, short transparencyCol)
+	{
+		BlitSpriteAlpha(x, y, sprite, ox, oy, w, h, transparencyCol);
+	}
+
+	void DrawSprite(int x, int y, const SpriteView& view)
+	{
+		if (view.IsValid())
+			BlitSprite(x, y, *view.sprite, view.x, view.y, view.width, view.height);
+	}
+
+	void DrawSpriteAlpha(int x, int y, const SpriteView& view, short transparencyCol)
+	{
+		if (view.IsValid())
+			BlitSpriteAlpha(x, y, *view.sprite, view.x, view.y, view.width, view.height, transparencyCol);
+	}
+
+	void DrawSprite(int x, int y, const PlanarSprite& sprite)
+	{
+		BlitPlanarSprite(x, y, sprite, 0, 0, sprite.GetWidth(), sprite.GetHeight());
+	}
+
+	void DrawSpriteAlpha(int x, int y, const PlanarSprite& sprite, short transparencyCol)
+	{
+		BlitPlanarSpriteAlpha(x, y, sprite, 0, 0, sprite.GetWidth(), sprite.GetHeight(), transparencyCol);
+	}
+
+	void DrawPartialSprite(int x, int y, const PlanarSprite& sprite, int ox, int oy, int w, int h)
+	{
+		BlitPlanarSprite(x, y, sprite, ox, oy, w, h);
+	}
+
+	void DrawPartialSpriteAlpha(int x, int y, const PlanarSprite& sprite, int ox, int oy, int w, int h, short transparencyCol)
+	{
+		BlitPlanarSpriteAlpha(x, y, sprite, ox, oy, w, h, transparencyCol);
+	}
+
+	//Fills length cells of row y, starting at x, with the sprite sampled from (u, v) onwards in steps of (du, dv) per cell,
+	//e.g. for the floors of raycasters or rotated sprites. Coordinates are the same as for Sprite::Sample().
+	void DrawSampledSpan(int x, int y, int length, const Sprite& sprite, float u, float v, float du, float dv)
+	{
+		int begin, end;
+		if (!ClipText(x, y, length, begin, end))
+			return;
+
+		sprite.SampleSpan(screen + screenWidth * y + x + begin, end - begin, u + du * (float)begin, v + dv * (float)begin, du, dv);
+	}
+
+	//Samples the level of the mipmap that matches the step
+	void DrawSampledSpan(int x, int y, int length, SpriteMipmap& mipmap, float u, float v, float du, float dv)
+	{
+		if (mipmap.GetLevelCount() > 0)
+			DrawSampledSpan(x, y, length, mipmap.GetLevel(mipmap.SelectLevel(du, dv)), u, v, du, dv);
+	}
+
+	//Samples the sprite at a coordinate per cell, given as arrays of length values
+	void DrawSampledSpan(int x, int y, int length, const Sprite& sprite, const float *u, const float *v)
+	{
+		int begin, end;
+		if (!ClipText(x, y, length, begin, end))
+			return;
+
+		CHAR_INFO *row = screen + screenWidth * y;
+		for (int i = begin; i < end; i++)
+			row[x + i] = sprite.Sample(u[i], v[i]);
+	}
+
+private:
+	//Clips a block of w*h cells that is taken from (ox, oy) of a source of the given size and drawn at (x, y) on the screen.
+	//Returns false if nothing remains visible.
+	bool ClipBlock(int &x, int &y, int &ox, int &oy, int &w, int &h, int sourceWidth, int sourceHeight)
+	{
+		return ClipBlock(x, y, ox, oy, w, h, sourceWidth, sourceHeight, ScreenClip());
+	}
+
+	bool ClipBlock(int &x, int &y, int &ox, int &oy, int &w, int &h, int sourceWidth, int sourceHeight, const ClipRect &clip)
+	{
+		//Parts of the block outside of the source
+		if (ox < 0) { x -= ox; w += ox; ox = 0; }
+		if (oy < 0) { y -= oy; h += oy; oy = 0; }
+		if (ox + w > sourceWidth) w = sourceWidth - ox;
+		if (oy + h > sourceHeight) h = sourceHeight - oy;
+
+		//Parts of the block outside of the clip rectangle
+		if (x < clip.left) { ox += clip.left - x; w -= clip.left - x; x = clip.left; }
+		if (y < clip.top) { oy += clip.top - y; h -= clip.top - y; y = clip.top; }
+		if (x + w > clip.right + 1) w = clip.right + 1 - x;
+		if (y + h > clip.bottom + 1) h = clip.bottom + 1 - y;
+
+		return w > 0 && h > 0;
+	}
+
+	//Finds the part [begin, end) of a text of the given length at (x, y) that lies on the screen
+	bool ClipText(int x, int y, int length, int &begin, int &end)
+	{
+		if (y < 0 || y >= screenHeight)
+			return false;
+
+		begin = max(-x, 0);
+		end = min(length, screenWidth - x);
+		return begin < end;
+	}
+
+	void BlitSprite(int x, int y, Sprite& sprite, int ox, int oy, int w, int h)
+	{
+		BlitSprite(x, y, sprite, ox, oy, w, h, ScreenClip());
+	}
+
+	void BlitSprite(int x, int y, Sprite& sprite, int ox, int oy, int w, int h, const ClipRect &clip)
+	{
+		if (!ClipBlock(x, y, ox, oy, w, h, sprite.GetWidth(), sprite.GetHeight(), clip))
+			return;
+
+		const CHAR_INFO *source = sprite.GetContents() + sprite.GetWidth() * oy + ox;
+		CHAR_INFO *destination = screen + screenWidth * y + x;
+
+		for (int j = 0; j < h; j++)
+		{
+			memcpy(destination, source, sizeof(CHAR_INFO) * w);
+			source += sprite.GetWidth();
+			destination += screenWidth;
+		}
+	}
+
+	void BlitSpriteAlpha(int x, int y, Sprite& sprite, int ox, int oy, int w, int h, short transparencyCol)
+	{
+		BlitSpriteAlpha(x, y, sprite, ox, oy, w, h, transparencyCol, ScreenClip());
+	}
+
+	void BlitSpriteAlpha(int x, int y, Sprite& sprite, int ox, int oy, int w, int h, short transparencyCol, const ClipRect &clip)
+	{
+		if (!ClipBlock(x, y, ox, oy, w, h, sprite.GetWidth(), sprite.GetHeight(), clip))
+			return;
+
+		const CHAR_INFO *source = sprite.GetContents() + sprite.GetWidth() * oy + ox;
+		CHAR_INFO *destination = screen + screenWidth * y + x;
+
+		for (int j = 0; j < h; j++)
+		{
+			CopySpanAlpha(destination, source, w, transparencyCol);
+			source += sprite.GetWidth();
+			destination += screenWidth;
+		}
+	}
+
+	void BlitPlanarSprite(int x, int y, const PlanarSprite& sprite, int ox, int oy, int w, int h)
+	{
+		if (!ClipBlock(x, y, ox, oy, w, h, sprite.GetWidth(), sprite.GetHeight()))
+			return;
+
+		int offset = sprite.GetWidth() * oy + ox;
+		CHAR_INFO *destination = screen + screenWidth * y + x;
+
+		for (int j = 0; j < h; j++)
+		{
+			InterleaveSpan(destination, sprite.GetGlyphs() + offset, sprite.GetColors() + offset, w);
+			offset += sprite.GetWidth();
+			destination += screenWidth;
+		}
+	}
+
+	void BlitPlanarSpriteAlpha(int x, int y, const PlanarSprite& sprite, int ox, int oy, int w, int h, short transparencyCol)
+	{
+		if (!ClipBlock(x, y, ox, oy, w, h, sprite.GetWidth(), sprite.GetHeight()))
+			return;
+
+		int offset = sprite.GetWidth() * oy + ox;
+		CHAR_INFO *destination = screen + screenWidth * y + x;
+
+		for (int j = 0; j < h; j++)
+		{
+			InterleaveSpanAlpha(destination, sprite.GetGlyphs() + offset, sprite.GetColors() + offset, w, transparencyCol);
+			offset += sprite.GetWidth();
+			destination += screenWidth;
+		}
+	}
+
+	//Pairs up characters and colors into cells
+	static void InterleaveSpan(CHAR_INFO *destination, const WORD *glyphs, const WORD *colors, int count)
+	{
+		int i = 0;
+
+#ifdef CGE_SSE2
+		for (; i + 8 <= count; i += 8)
+		{
+			__m128i g = _mm_loadu_si128((const __m128i*)(glyphs + i));
+			__m128i c = _mm_loadu_si128((const __m128i*)(colors + i));
+			_mm_storeu_si128((__m128i*)(destination + i), _mm_unpacklo_epi16(g, c));
+			_mm_storeu_si128((__m128i*)(destination + i + 4), _mm_unpackhi_epi16(g, c));
+		}
+#endif
+
+		for (; i < count; i++)
+		{
+			destination[i].Char.UnicodeChar = glyphs[i];
+			destination[i].Attributes = colors[i];
+		}
+	}
+
+	static void InterleaveSpanAlpha(CHAR_INFO *destination, const WORD *glyphs, const WORD *colors, int count, short transparencyCol)
+	{
+		int i = 0;
+
+#ifdef CGE_SSE2
+		const __m128i transparentKey = _mm_set1_epi16(transparencyCol);
+
+		for (; i + 8 <= count; i += 8)
+		{
+			__m128i g = _mm_loadu_si128((const __m128i*)(glyphs + i));
+			__m128i c = _mm_loadu_si128((const __m128i*)(colors + i));
+			__m128i transparent = _mm_cmpeq_epi16(c, transparentKey);
+
+			//Widen the 16-bit mask of every color to the whole cell
+			__m128i transparentLow = _mm_unpacklo_epi16(transparent, transparent);
+			__m128i transparentHigh = _mm_unpackhi_epi16(transparent, transparent);
+
+			__m128i dstLow = _mm_loadu_si128((const __m128i*)(destination + i));
+			__m128i dstHigh = _mm_loadu_si128((const __m128i*)(destination + i + 4));
+
+			_mm_storeu_si128((__m128i*)(destination + i), _mm_or_si128(_mm_and_si128(transparentLow, dstLow), _mm_andnot_si128(transparentLow, _mm_unpacklo_epi16(g, c))));
+			_mm_storeu_si128((__m128i*)(destination + i + 4), _mm_or_si128(_mm_and_si128(transparentHigh, dstHigh), _mm_andnot_si128(transparentHigh, _mm_unpackhi_epi16(g, c))));
+		}
+#endif
+
+		for (; i < count; i++)
+		{
+			if ((short)colors[i] != transparencyCol)
+			{
+				destination[i].Char.UnicodeChar = glyphs[i];
+				destination[i].Attributes = colors[i];
+			}
+		}
+	}
+
+	//Copies the cells whose color differs from the transparency color
+	static void CopySpanAlpha(CHAR_INFO *destination, const CHAR_INFO *source, int count, short transparencyCol)
+	{
+		int i = 0;
+
+#ifdef CGE_SSE2
+		//A cell is 4 bytes: the character in the low half and the attributes in the high half
+		const __m128i attributeMask = _mm_set1_epi32((int)0xFFFF0000);
+		const __m128i transparentKey = _mm_set1_epi32((int)((unsigned int)(unsigned short)transparencyCol << 16));
+
+		for (; i + 4 <= count; i += 4)
+		{
+			__m128i src = _mm_loadu_si128((const __m128i*)(source + i));
+			__m128i dst = _mm_loadu_si128((const __m128i*)(destination + i));
+			__m128i transparent = _mm_cmpeq_epi32(_mm_and_si128(src, attributeMask), transparentKey);
+			_mm_storeu_si128((__m128i*)(destination + i), _mm_or_si128(_mm_and_si128(transparent, dst), _mm_andnot_si128(transparent, src)));
+		}
+#endif
+
+		for (; i < count; i++)
+		{
+			if ((short)source[i].Attributes != transparencyCol)
+				destination[i] = source[i];
+		}
+	}
+
+protected:
+	//Writes the text into a single row, clipped to the screen. Returns the length of the text, so that several
+	//pieces can be written one after another.
+	int DisplayText(int x, int y, std::wstring_view text, short bgColor = DEFAULT_COLOR, short fgColor = FG_BLACK)
+	{
+		int begin, end;
+		if (ClipText(x, y, (int)text.size(), begin, end))
+		{
+			CHAR_INFO *row = screen + screenWidth * y;
+			short color = bgColor | fgColor;
+
+			for (int i = begin; i < end; i++)
+			{
+				row[x + i].Char.UnicodeChar = text[i];
+				row[x + i].Attributes = color;
+			}
+		}
+
+		return (int)text.size();
+	}
+
+	int DisplayText(int x, int y, const wchar_t *text, short bgColor = DEFAULT_COLOR, short fgColor = FG_BLACK)
+	{
+		return DisplayText(x, y, std::wstring_view(text), bgColor, fgColor);
+	}
+
+	//Same as DisplayText(), except that spaces leave the screen untouched
+	int DisplayTextAlpha(int x, int y, std::wstring_view text, short bgColor = DEFAULT_COLOR, short fgColor = FG_BLACK)
+	{
+		int begin, end;
+		if (ClipText(x, y, (int)text.size(), begin, end))
+		{
+			CHAR_INFO *row = screen + screenWidth * y;
+			short color = bgColor | fgColor;
+
+			for (int i = begin; i < end; i++)
+			{
+				if (text[i] != L' ')
+				{
+					row[x + i].Char.UnicodeChar = text[i];
+					row[x + i].Attributes = color;
+				}
+			}
+		}
+
+		return (int)text.size();
+	}
+
+	int DisplayTextAlpha(int x, int y, const wchar_t *text, short bgColor = DEFAULT_COLOR, short fgColor = FG_BLACK)
+	{
+		return DisplayTextAlpha(x, y, std::wstring_view(text), bgColor, fgColor);
+	}
+
+	void DisplayText(int x, int y, TextLabel& label)
+	{
+		Sprite &sprite = label.GetSprite();
+		BlitSprite(x, y, sprite, 0, 0, sprite.GetWidth(), sprite.GetHeight());
+	}
+
+	void DisplayTextAlpha(int x, int y, TextLabel& label)
+	{
+		Sprite &sprite = label.GetSprite();
+
+		int ox = 0, oy = 0, w = sprite.GetWidth(), h = sprite.GetHeight();
+		if (!ClipBlock(x, y, ox, oy, w, h, sprite.GetWidth(), sprite.GetHeight()))
+			return;
+
+		for (int j = 0; j < h; j++)
+		{
+			const CHAR_INFO *source = sprite.GetContents() + sprite.GetWidth() * (oy + j) + ox;
+			CHAR_INFO *destination = screen + screenWidth * (y + j) + x;
+
+			for (int i = 0; i < w; i++)
+			{
+				if (source[i].Char.UnicodeChar != L' ')
+					destination[i] = source[i];
+			}
+		}
+	}
+
+	//Writes the digits straight into the screen without building a string. Returns the number of characters.
+	int DisplayNumber(int x, int y, long long value, short bgColor = DEFAULT_COLOR, short fgColor = FG_BLACK)
+	{
+		wchar_t digits[24];
+		wchar_t *out = digits;
+
+		if (value < 0)
+			*out++ = L'-';
+
+		out = WriteNumber(out, value < 0 ? 0ULL - (unsigned long long)value : (unsigned long long)value);
+		return DisplayText(x, y, std::wstring_view(digits, out - digits), bgColor, fgColor);
+	}
+
+	//Writes the value rounded to the given number of decimals (at most 9)
+	int DisplayDecimal(int x, int y, double value, int decimals = 2, short bgColor = DEFAULT_COLOR, short fgColor = FG_BLACK)
+	{
+		static const unsigned long long scales[10] = { 1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL, 100000000ULL, 1000000000ULL };
+
+		decimals = min(max(decimals, 0), 9);
+
+		wchar_t digits[48];
+		wchar_t *out = digits;
+
+		//Values that don't fit into 64 bits once scaled, as well as infinities and NaNs, are left to the CRT.
+		//They are still written without an exponent, which takes up to 309 digits for the largest doubles.
+		double magnitude = fabs(value) * (double)scales[decimals];
+		if (!(magnitude < 1e18))
+		{
+			wchar_t wide[328];
+			int count = swprintf_s(wide, L"%.*f", decimals, value);
+			return DisplayText(x, y, std::wstring_view(wide, max(count, 0)), bgColor, fgColor);
+		}
+
+		unsigned long long scaled = (unsigned long long)(magnitude + 0.5);
+		if (value < 0.0 && scaled != 0)
+			*out++ = L'-';
+
+		out = WriteNumber(out, scaled / scales[decimals]);
+
+		if (decimals > 0)
+		{
+			unsigned long long fraction = scaled % scales[decimals];
+
+			*out++ = L'.';
+			for (int i = decimals - 1; i >= 0; i--)
+			{
+				out[i] = (wchar_t)(L'0' + fraction % 10);
+				fraction /= 10;
+			}
+			out += decimals;
+		}
+
+		return DisplayText(x, y, std::wstring_view(digits, out - digits), bgColor, fgColor);
+	}
+
+	void Fill(int x, int y, int length, short character = DEFAULT_CHAR, short color = DEFAULT_COLOR)
+	{
+		//The span may continue onto the following rows, so it is only clipped to the buffer
+		int begin = screenWidth * y + x;
+		int end = begin + length;
+
+		if (begin < 0)
+			begin = 0;
+		if (end > screenWidth * screenHeight)
+			end = screenWidth * screenHeight;
+
+		if (begin < end)
+			FillSpan(screen + begin, end - begin, MakeCell(character, color));
+	}
+
+	void ClearScreen(short character = DEFAULT_CHAR, short color = BG_BLACK)
+	{
+		FillSpan(screen, screenWidth * screenHeight, MakeCell(character, color));
+	}
+
+	void FloodFill(int x, int y, short color = DEFAULT_COLOR)
+	{
+		FloodFill(x, y, DEFAULT_CHAR, color, FILL_COLOR);
+	}
+
+	//Fills the 4-connected area around (x, y) whose cells match the one at (x, y) in the character, the color or both.
+	//Only the matched parts of the cells are replaced.
+	void FloodFill(int x, int y, short character, short color, FloodFillMode mode)
+	{
+		if (x < 0 || x >= screenWidth || y < 0 || y >= screenHeight) return;
+
+		//Cells are compared as whole 32-bit values, masked down to the parts that have to match
+		const unsigned int mask = (mode == FILL_COLOR) ? 0xFFFF0000 : (mode == FILL_CHARACTER) ? 0x0000FFFF : 0xFFFFFFFF;
+		const unsigned int target = (unsigned int)PackCell(screen[screenWidth * y + x]) & mask;
+		const unsigned int replacement = (unsigned int)PackCell(MakeCell(character, color)) & mask;
+
+		//Filling an area with what it already contains would never finish
+		if (target == replacement) return;
+
+		CHAR_INFO *cells = screen;
+		const int width = screenWidth;
+
+		//Pushes one seed for every run of matching cells between the two indices of a row
+		auto pushSeeds = [&](int begin, int end)
+		{
+			for (int i = FindCell(cells, begin, end + 1, mask, target, true); i <= end; i = FindCell(cells, i, end + 1, mask, target, true))
+			{
+				floodFillStack.push_back(i);
+				i = FindCell(cells, i, end + 1, mask, target, false);
+			}
+		};
+
+		floodFillStack.clear();
+		floodFillStack.push_back(width * y + x);
+
+		while (!floodFillStack.empty())
+		{
+			int seed = floodFillStack.back();
+			floodFillStack.pop_back();
+
+			//The seed may have been filled by another span in the meantime
+			if (((unsigned int)PackCell(cells[seed]) & mask) != target)
+				continue;
+
+			//Extend the seed to a span, without wrapping around to the neighbouring rows
+			int row = seed / width;
+			int rowStart = width * row;
+			int left = FindCellReverse(cells, rowStart, seed, mask, target, false) + 1;
+			int right = FindCell(cells, seed, rowStart + width, mask, target, false) - 1;
+
+			ReplaceCells(cells + left, right - left + 1, mask, replacement);
+
+			if (row > 0)
+				pushSeeds(left - width, right - width);
+			if (row < screenHeight - 1)
+				pushSeeds(left + width, right + width);
+		}
+	}
+
+private:
+	//Index of the first cell in [begin, end) that does or doesn't match the target under the mask, or end if there is none
+	static int FindCell(const CHAR_INFO *cells, int begin, int end, unsigned int mask, unsigned int target, bool match)
+	{
+		int i = begin;
+
+#ifdef CGE_SSE2
+		const __m128i cellMask = _mm_set1_epi32((int)mask);
+		const __m128i targetCell = _mm_set1_epi32((int)target);
+
+		for (; i + 4 <= end; i += 4)
+		{
+			__m128i equal = _mm_cmpeq_epi32(_mm_and_si128(_mm_loadu_si128((const __m128i*)(cells + i)), cellMask), targetCell);
+			int found = _mm_movemask_ps(_mm_castsi128_ps(equal)) ^ (match ? 0 : 0xF);
+
+			if (found != 0)
+			{
+				while ((found & 1) == 0)
+				{
+					found >>= 1;
+					i++;
+				}
+				return i;
+			}
+		}
+#endif
+
+		for (; i < end; i++)
+		{
+			if ((((unsigned int)PackCell(cells[i]) & mask) == target) == match)
+				return i;
+		}
+
+		return end;
+	}
+
+	//Overwrites the parts of the cells selected by the mask
+	static void ReplaceCells(CHAR_INFO *cells, int count, unsigned int mask, unsigned int replacement)
+	{
+		int i = 0;
+
+#ifdef CGE_SSE2
+		const __m128i keep = _mm_set1_epi32((int)~mask);
+		const __m128i replacementCell = _mm_set1_epi32((int)replacement);
+
+		for (; i + 4 <= count; i += 4)
+		{
+			__m128i current = _mm_loadu_si128((const __m128i*)(cells + i));
+			_mm_storeu_si128((__m128i*)(cells + i), _mm_or_si128(_mm_and_si128(current, keep), replacementCell));
+		}
+#endif
+
+		for (; i < count; i++)
+		{
+			unsigned int cell = ((unsigned int)PackCell(cells[i]) & ~mask) | replacement;
+			memcpy(&cells[i], &cell, sizeof(CHAR_INFO));
+		}
+	}
+
+	//Index of the last cell in [begin, end) that does or doesn't match the target under the mask, or begin - 1 if there is none
+	static int FindCellReverse(const CHAR_INFO *cells, int begin, int end, unsigned int mask, unsigned int target, bool match)
+	{
+		int i = end;
+
+#ifdef CGE_SSE2
+		const __m128i cellMask = _mm_set1_epi32((int)mask);
+		const __m128i targetCell = _mm_set1_epi32((int)target);
+
+		for (; i - 4 >= begin; i -= 4)
+		{
+			__m128i equal = _mm_cmpeq_epi32(_mm_and_si128(_mm_loadu_si128((const __m128i*)(cells + i - 4)), cellMask), targetCell);
+			int found = _mm_movemask_ps(_mm_castsi128_ps(equal)) ^ (match ? 0 : 0xF);
+
+			if (found != 0)
+			{
+				for (int k = 3; k >= 0; k--)
+				{
+					if (found & (1 << k))
+						return i - 4 + k;
+				}
+			}
+		}
+#endif
+
+		for (i--; i >= begin; i--)
+		{
+			if ((((unsigned int)PackCell(cells[i]) & mask) == target) == match)
+				return i;
+		}
+
+		return begin - 1;
+	}
+
+protected:
+	void Clip(int &x, int &y)
+	{
+		if (x < 0)
+			x = 0;
+		else if (x > screenWidth)
+			x = screenWidth;
+
+		if (y < 0)
+			y = 0;
+		else if (y > screenHeight)
+			y = screenHeight;
+	}
+
+	////////////////////////////////////////// DRAW LIST ///////////////////////////////////////////
+
+public:
+	enum DrawCommandType
+	{
+		DRAW_LINE,
+		DRAW_RECTANGLE,
+		DRAW_FILLED_RECTANGLE,
+		DRAW_TRIANGLE,
+		DRAW_FILLED_TRIANGLE,
+		DRAW_CIRCLE,
+		DRAW_FILLED_CIRCLE,
+		DRAW_SPRITE,
+		DRAW_SPRITE_ALPHA
+	};
+
+	//Primitives recorded with a z-order and drawn later by ExecuteDrawList(), lowest z first. Within the same z, commands are
+	//grouped by sprite, so overlapping commands that have to keep their order need different z values. The storage is kept
+	//when the list is cleared, so a list that is refilled every frame stops allocating once it has grown large enough.
+	//Sprites must stay alive until the list is executed.
+	class DrawList
+	{
+	private:
+		struct Command
+		{
+			DrawCommandType type;
+			int z;
+			int sequence;
+			ClipRect bounds;
+
+			int x0, y0, x1, y1, x2, y2;
+			short character, color;
+
+			Sprite *sprite;
+			short transparencyCol;
+		};
+
+		std::vector<Command> commands;
+
+		//Filled by ExecuteDrawList()
+		std::vector<int> order;
+		std::vector<std::vector<int>> bins;
+		int culled = 0;
+
+		friend class ConsoleGameEngine;
+
+		Command& Add(DrawCommandType type, int z, short character, short color)
+		{
+			commands.emplace_back();
+
+			Command &command = commands.back();
+			command.type = type;
+			command.z = z;
+			command.sequence = (int)commands.size() - 1;
+			command.character = character;
+			command.color = color;
+			command.sprite = nullptr;
+			command.transparencyCol = 0;
+			return command;
+		}
+
+		Command& AddPoints(DrawCommandType type, int z, int x0, int y0, int x1, int y1, short character, short color)
+		{
+			Command &command = Add(type, z, character, color);
+			command.x0 = x0;
+			command.y0 = y0;
+			command.x1 = x1;
+			command.y1 = y1;
+			command.bounds = { min(x0, x1), min(y0, y1), max(x0, x1), max(y0, y1) };
+			return command;
+		}
+
+		void AddTriangle(DrawCommandType type, int z, int x0, int y0, int x1, int y1, int x2, int y2, short character, short color)
+		{
+			Command &command = AddPoints(type, z, x0, y0, x1, y1, character, color);
+			command.x2 = x2;
+			command.y2 = y2;
+			command.bounds = { min(command.bounds.left, x2), min(command.bounds.top, y2), max(command.bounds.right, x2), max(command.bounds.bottom, y2) };
+		}
+
+		void AddCircle(DrawCommandType type, int z, int cx, int cy, int r, short character, short color)
+		{
+			//Circles with a negative radius draw nothing, so their bounds are left empty
+			Command &command = Add(type, z, character, color);
+			command.x0 = cx;
+			command.y0 = cy;
+			command.x1 = r;
+			command.bounds = { cx - r, cy - r, cx + r, cy + r };
+		}
+
+		void AddSprite(DrawCommandType type, int z, int x, int y, Sprite& sprite, int ox, int oy, int w, int h, short transparencyCol)
+		{
+			Command &command = Add(type, z, 0, 0);
+			command.x0 = x;
+			command.y0 = y;
+			command.x1 = ox;
+			command.y1 = oy;
+			command.x2 = w;
+			command.y2 = h;
+			command.sprite = &sprite;
+			command.transparencyCol = transparencyCol;
+			command.bounds = { x, y, x + w - 1, y + h - 1 };
+		}
+
+	public:
+		void Clear()
+		{
+			commands.clear();
+		}
+
+		int GetSize() const
+		{
+			return (int)commands.size();
+		}
+
+		//Number of commands that were skipped by the last execution because they lie outside of the screen
+		int GetCulledCount() const
+		{
+			return culled;
+		}
+
+		void DrawLine(int z, int x0, int y0, int x1, int y1, short character = DEFAULT_CHAR, short color = DEFAULT_COLOR)
+		{
+			AddPoints(DRAW_LINE, z, x0, y0, x1, y1, character, color);
+		}
+
+		void DrawRectangle(int z, int x0, int y0, int x1, int y1, short character = DEFAULT_CHAR, short color = DEFAULT_COLOR)
+		{
+			AddPoints(DRAW_RECTANGLE, z, x0, y0, x1, y1, character, color);
+		}
+
+		void DrawFilledRectangle(int z, int x0, int y0, int x1, int y1, short character = DEFAULT_CHAR, short color = DEFAULT_COLOR)
+		{
+			AddPoints(DRAW_FILLED_RECTANGLE, z, x0, y0, x1, y1, character, color);
+		}
+
+		void DrawTriangle(int z, int x0, int y0, int x1, int y1, int x2, int y2, short character = DEFAULT_CHAR, short color = DEFAULT_COLOR)
+		{
+			AddTriangle(DRAW_TRIANGLE, z, x0, y0, x1, y1, x2, y2, character, color);
+		}
+
+		void DrawFilledTriangle(int z, int x0, int y0, int x1, int y1, int x2, int y2, short character = DEFAULT_CHAR, short color = DEFAULT_COLOR)
+		{
+			AddTriangle(DRAW_FILLED_TRIANGLE, z, x0, y0, x1, y1, x2, y2, character, color);
+		}
+
+		void DrawCircle(int z, int cx, int cy, int r, short character = DEFAULT_CHAR, short color = DEFAULT_COLOR)
+		{
+			AddCircle(DRAW_CIRCLE, z, cx, cy, r, character, color);
+		}
+
+		void DrawFilledCircle(int z, int cx, int cy, int r, short character = DEFAULT_CHAR, short color = DEFAULT_COLOR)
+		{
+			AddCircle(DRAW_FILLED_CIRCLE, z, cx, cy, r, character, color);
+		}
+
+		void DrawSprite(int z, int x, int y, Sprite& sprite)
+		{
+			AddSprite(DRAW_SPRITE, z, x, y, sprite, 0, 0, sprite.GetWidth(), sprite.GetHeight(), 0);
+		}
+
+		void DrawSpriteAlpha(int z, int x, int y, Sprite& sprite, short transparencyCol)
+		{
+			AddSprite(DRAW_SPRITE_ALPHA, z, x, y, sprite, 0, 0, sprite.GetWidth(), sprite.GetHeight(), transparencyCol);
+		}
+
+		void DrawPartialSprite(int z, int x, int y, Sprite& sprite, int ox, int oy, int w, int h)
+		{
+			AddSprite(DRAW_SPRITE, z, x, y, sprite, ox, oy, w, h, 0);
+		}
+
+		void DrawPartialSpriteAlpha(int z, int x, int y, Sprite& sprite, int ox, int oy, int w, int h, short transparencyCol)
+		{
+			AddSprite(DRAW_SPRITE_ALPHA, z, x, y, sprite, ox, oy, w, h, transparencyCol);
+		}
+
+		void DrawSprite(int z, int x, int y, const SpriteView& view)
+		{
+			if (view.IsValid())
+				AddSprite(DRAW_SPRITE, z, x, y, *view.sprite, view.x, view.y, view.width, view.height, 0);
+		}
+
+		void DrawSpriteAlpha(int z, int x, int y, const SpriteView& view, short transparencyCol)
+		{
+			if (view.IsValid())
+				AddSprite(DRAW_SPRITE_ALPHA, z, x, y, *view.sprite, view.x, view.y, view.width, view.height, transparencyCol);
+		}
+	};
+
+private:
+	void ExecuteDrawCommand(const DrawList::Command &c, const ClipRect &clip)
+	{
+		switch (c.type)
+		{
+			case DRAW_LINE:
+				RasterLine(c.x0, c.y0, c.x1, c.y1, c.character, c.color, clip);
+				break;
+			case DRAW_RECTANGLE:
+				RasterRectangle(c.x0, c.y0, c.x1, c.y1, c.character, c.color, clip);
+				break;
+			case DRAW_FILLED_RECTANGLE:
+				RasterFilledRectangle(c.x0, c.y0, c.x1, c.y1, c.character, c.color, clip);
+				break;
+			case DRAW_TRIANGLE:
+				RasterTriangle(c.x0, c.y0, c.x1, c.y1, c.x2, c.y2, c.character, c.color, clip);
+				break;
+			case DRAW_FILLED_TRIANGLE:
+				RasterFilledTriangle(c.x0, c.y0, c.x1, c.y1, c.x2, c.y2, c.character, c.color, clip);
+				break;
+			case DRAW_CIRCLE:
+				RasterCircle(c.x0, c.y0, c.x1, c.character, c.color, clip);
+				break;
+			case DRAW_FILLED_CIRCLE:
+				RasterFilledCircle(c.x0, c.y0, c.x1, c.character, c.color, clip);
+				break;
+			case DRAW_SPRITE:
+				BlitSprite(c.x0, c.y0, *c.sprite, c.x1, c.y1, c.x2, c.y2, clip);
+				break;
+			case DRAW_SPRITE_ALPHA:
+				BlitSpriteAlpha(c.x0, c.y0, *c.sprite, c.x1, c.y1, c.x2, c.y2, c.transparencyCol, clip);
+				break;
+		}
+	}
+
+	static bool Overlaps(const ClipRect &a, const ClipRect &b)
+	{
+		return a.left <= b.right && a.right >= b.left && a.top <= b.bottom && a.bottom >= b.top;
+	}
+
+protected:
+	//Draws the commands of the list, skipping those whose bounds lie outside of the screen. The list itself is left intact,
+	//so it may be executed again or cleared for the next frame.
+	//In parallel, the screen is split into bands of rows. Commands are binned by the bands they overlap and every band
+	//is drawn by the worker pool with the commands clipped to it, which gives the same result as drawing them in order.
+	void ExecuteDrawList(DrawList &list, bool parallel = false)
+	{
+		const ClipRect clip = ScreenClip();
+
+		list.order.clear();
+		list.culled = 0;
+
+		for (int i = 0; i < (int)list.commands.size(); i++)
+		{
+			const DrawList::Command &command = list.commands[i];
+			if (command.bounds.left <= command.bounds.right && command.bounds.top <= command.bounds.bottom && Overlaps(command.bounds, clip))
+				list.order.push_back(i);
+			else
+				list.culled++;
+		}
+
+		std::sort(list.order.begin(), list.order.end(), [&list](int a, int b)
+		{
+			const DrawList::Command &first = list.commands[a];
+			const DrawList::Command &second = list.commands[b];
+
+			if (first.z != second.z)
+				return first.z < second.z;
+			if (first.sprite != second.sprite)
+				return std::less<Sprite*>()(first.sprite, second.sprite);
+			return first.sequence < second.sequence;
+		});
+
+		if (!parallel)
+		{
+			for (int i : list.order)
+				ExecuteDrawCommand(list.commands[i], clip);
+			return;
+		}
+
+		int rowsPerBand = GetRowsPerBand();
+		int bands = (screenHeight + rowsPerBand - 1) / rowsPerBand;
+
+		if ((int)list.bins.size() < bands)
+			list.bins.resize(bands);
+
+		for (int band = 0; band < bands; band++)
+			list.bins[band].clear();
+
+		for (int i : list.order)
+		{
+			const ClipRect &bounds = list.commands[i].bounds;
+			int first = max(bounds.top, 0) / rowsPerBand;
+			int last = min(bounds.bottom, screenHeight - 1) / rowsPerBand;
+
+			for (int band = first; band <= last; band++)
+				list.bins[band].push_back(i);
+		}
+
+		RunJob(bands, [&](int band)
+		{
+			ClipRect bandClip = { 0, band * rowsPerBand, screenWidth - 1, min((band + 1) * rowsPerBand, screenHeight) - 1 };
+
+			for (int i : list.bins[band])
+				ExecuteDrawCommand(list.commands[i], bandClip);
+		});
+	}
+
+	//////////////////////////////////////////// LAYERS ////////////////////////////////////////////
+
+private:
+	struct Layer
+	{
+		std::wstring name;
+		std::vector<CHAR_INFO> cells;
+		std::vector<CHAR_INFO> composited;	//Contents at the last composite, used to find the rows that changed
+		short transparencyCol;
+		bool visible;
+		bool touched;
+	};
+
+	std::vector<Layer> layers;
+	int activeLayer = -1;
+
+	//Rows of the composite that have to be rebuilt
+	std::vector<char> layerDirtyRows;
+
+	//The visible layers blended together, and whether a layer covers each of its cells. The composite is cached
+	//between frames and only rebuilt where a layer changed. Opaque composites are only copied into the screen where
+	//they changed, while in half-block mode the covered cells are copied every frame over the freshly packed pixels.
+	std::vector<CHAR_INFO> layerComposite;
+	std::vector<BYTE> layerCoverage;
+	bool layerCompositeOpaque = false;
+	bool layerCompositeEmpty = true;
+
+	//Set when something else than the composite was drawn into the screen, e.g. the profiler overlay
+	bool layerScreenStale = false;
+
+	//Takes what is drawn straight into the screen while opaque layers replace it anyway, so that the composite
+	//left in the screen from the previous frames stays intact
+	std::vector<CHAR_INFO> layerScratch;
+
+	bool LayersReplaceScreen()
+	{
+		if (halfBlockMode)
+			return false;
+
+		for (const Layer &layer : layers)
+		{
+			if (layer.visible)
+				return true;
+		}
+
+		return false;
+	}
+
+	void MarkLayersDirty()
+	{
+		layerDirtyRows.assign(screenHeight, 1);
+	}
+
+	//Rebuilds the rows of the composite where a visible layer changed, then copies them into the screen. Only layers
+	//selected since the last composite are compared against their previous contents, so untouched layers cost nothing.
+	//In half-block mode the layers are blended over the pixels, so even the bottom layer has a transparent color.
+	void CompositeLayers()
+	{
+		SetLayer(-1);
+
+		if (layers.empty())
+			return;
+
+		bool copyAll = layerScreenStale;
+		layerScreenStale = false;
+
+		for (Layer &layer : layers)
+		{
+			if (!layer.touched)
+				continue;
+
+			layer.touched = false;
+
+			for (int y = 0; y < screenHeight; y++)
+			{
+				const CHAR_INFO *row = layer.cells.data() + screenWidth * y;
+				CHAR_INFO *compositedRow = layer.composited.data() + screenWidth * y;
+
+				if (memcmp(row, compositedRow, sizeof(CHAR_INFO) * screenWidth) == 0)
+					continue;
+
+				memcpy(compositedRow, row, sizeof(CHAR_INFO) * screenWidth);
+
+				//Hidden layers are still tracked, but showing them again redraws everything anyway
+				if (layer.visible)
+					layerDirtyRows[y] = 1;
+			}
+		}
+
+		if (layerCompositeOpaque == halfBlockMode)
+		{
+			layerCompositeOpaque = !halfBlockMode;
+			MarkLayersDirty();
+		}
+
+		layerCompositeEmpty = true;
+		for (const Layer &layer : layers)
+			layerCompositeEmpty = layerCompositeEmpty && !layer.visible;
+
+		//Rebuilt rows of an opaque composite go straight into the screen, the rest of it is still there from before
+		bool copyRows = layerCompositeOpaque && !layerCompositeEmpty && !copyAll;
+
+		for (int y = 0; y < screenHeight; y++)
+		{
+			if (!layerDirtyRows[y])
+				continue;
+
+			layerDirtyRows[y] = 0;
+
+			CHAR_INFO *row = layerComposite.data() + screenWidth * y;
+			BYTE *coverage = layerCoverage.data() + screenWidth * y;
+			bool first = layerCompositeOpaque;
+
+			if (!layerCompositeOpaque)
+				memset(coverage, 0, screenWidth);
+
+			for (const Layer &layer : layers)
+			{
+				if (!layer.visible)
+					continue;
+
+				const CHAR_INFO *layerRow = layer.cells.data() + screenWidth * y;
+				if (first)
+					memcpy(row, layerRow, sizeof(CHAR_INFO) * screenWidth);
+				else if (layerCompositeOpaque)
+					CopySpanAlpha(row, layerRow, screenWidth, layer.transparencyCol);
+				else
+				{
+					for (int x = 0; x < screenWidth; x++)
+					{
+						if ((short)layerRow[x].Attributes != layer.transparencyCol)
+						{
+							row[x] = layerRow[x];
+							coverage[x] = 1;
+						}
+					}
+				}
+
+				first = false;
+			}
+
+			if (copyRows)
+				memcpy(mainScreen + screenWidth * y, row, sizeof(CHAR_INFO) * screenWidth);
+		}
+
+		if (layerCompositeEmpty)
+			return;
+
+		if (layerCompositeOpaque)
+		{
+			if (copyAll)
+				memcpy(mainScreen, layerComposite.data(), sizeof(CHAR_INFO) * screenWidth * screenHeight);
+			return;
+		}
+
+		for (int i = 0; i < screenWidth * screenHeight; i++)
+		{
+			if (layerCoverage[i])
+				mainScreen[i] = layerComposite[i];
+		}
+	}
+
+protected:
+	//Adds a layer on top of the existing ones and returns its index. If a layer with this name exists already, its index is returned.
+	//Layers are composited into the screen after OnUpdate(), skipping the cells of the transparency color like DrawSpriteAlpha() does.
+	//The bottom layer is opaque, so while any layer is visible it replaces whatever was drawn straight into the screen.
+	//Such drawing goes to a scratch buffer in the meantime, which is also what GetScreenCharacter() and GetScreenColor() read.
+	//Returns -1 if the screen hasn't been constructed yet.
+	int AddLayer(const std::wstring &name, short transparencyCol = BG_BLACK)
+	{
+		if (mainScreen == nullptr)
+			return -1;
+
+		int index = FindLayer(name);
+		if (index >= 0)
+			return index;
+
+		if (layers.empty())
+		{
+			layerComposite.assign((size_t)screenWidth * screenHeight, CHAR_INFO());
+			layerCoverage.assign((size_t)screenWidth * screenHeight, 0);
+			layerScratch.assign((size_t)screenWidth * screenHeight, CHAR_INFO());
+		}
+
+		Layer layer;
+		layer.name = name;
+		layer.cells.assign(screenWidth * screenHeight, MakeCell(DEFAULT_CHAR, transparencyCol));
+		layer.composited = layer.cells;
+		layer.transparencyCol = transparencyCol;
+		layer.visible = true;
+		layer.touched = false;
+
+		//Drawing may be redirected to a layer whose buffer moves along with it
+		int active = activeLayer;
+		SetLayer(-1);
+		layers.push_back(std::move(layer));
+		SetLayer(active);
+
+		MarkLayersDirty();
+		return (int)layers.size() - 1;
+	}
+
+	int FindLayer(const std::wstring &name)
+	{
+		for (size_t i = 0; i < layers.size(); i++)
+		{
+			if (layers[i].name == name)
+				return (int)i;
+		}
+
+		return -1;
+	}
+
+	//Redirects all drawing to the layer, or back to the screen for -1. Selection is reset to the screen after every frame.
+	void SetLayer(int index)
+	{
+		if (index >= (int)layers.size())
+			return;
+
+		activeLayer = max(index, -1);
+
+		if (activeLayer < 0)
+		{
+			screen = LayersReplaceScreen() ? layerScratch.data() : mainScreen;
+			return;
+		}
+
+		screen = layers[activeLayer].cells.data();
+		layers[activeLayer].touched = true;
+	}
+
+	int GetLayer()
+	{
+		return activeLayer;
+	}
+
+	int GetLayerCount()
+	{
+		return (int)layers.size();
+	}
+
+	void SetLayerVisible(int index, bool visible)
+	{
+		if (index < 0 || index >= (int)layers.size() || layers[index].visible == visible)
+			return;
+
+		layers[index].visible = visible;
+		MarkLayersDirty();
+
+		//Drawing straight into the screen may have to show again, or be replaced from now on
+		if (activeLayer < 0)
+			SetLayer(-1);
+	}
+
+	bool IsLayerVisible(int index)
+	{
+		return index >= 0 && index < (int)layers.size() && layers[index].visible;
+	}
+
+	//The screen keeps the last composite until it's drawn over
+	void RemoveLayers()
+	{
+		layers.clear();
+		SetLayer(-1);
+
+		layerDirtyRows.clear();
+		layerComposite.clear();
+		layerCoverage.clear();
+		layerScratch.clear();
+		layerCompositeEmpty = true;
+		layerScreenStale = false;
+		fullPresentRequired = true;
+	}
+
+	////////////////////////////////////////// HALF-BLOCK //////////////////////////////////////////
+
+private:
+	//Pixels of the half-block mode, a column of two per cell, each holding one of the 16 colors
+	std::vector<BYTE> halfBlockPixels;
+	bool halfBlockMode = false;
+
+	//Turns every vertical pair of pixels into an upper half block, with the top pixel as the foreground
+	//and the bottom one as the background
+	void PackHalfBlocks()
+	{
+		if (halfBlockPixels.empty())
+			return;
+
+		for (int y = 0; y < screenHeight; y++)
+		{
+			const BYTE *top = halfBlockPixels.data() + screenWidth * 2 * y;
+			const BYTE *bottom = top + screenWidth;
+			CHAR_INFO *row = mainScreen + screenWidth * y;
+
+			int x = 0;
+#ifdef CGE_SSE2
+			const __m128i glyph = _mm_set1_epi16((short)PIXEL_UPPER_HALF);
+			const __m128i zero = _mm_setzero_si128();
+
+			for (; x + 16 <= screenWidth; x += 16)
+			{
+				//Pixels are kept within 0-15, so shifting whole words cannot carry bits into the neighbouring byte
+				__m128i attributes = _mm_or_si128(_mm_loadu_si128((const __m128i *)(top + x)), _mm_slli_epi16(_mm_loadu_si128((const __m128i *)(bottom + x)), 4));
+				__m128i low = _mm_unpacklo_epi8(attributes, zero);
+				__m128i high = _mm_unpackhi_epi8(attributes, zero);
+
+				_mm_storeu_si128((__m128i *)(row + x), _mm_unpacklo_epi16(glyph, low));
+				_mm_storeu_si128((__m128i *)(row + x + 4), _mm_unpackhi_epi16(glyph, low));
+				_mm_storeu_si128((__m128i *)(row + x + 8), _mm_unpacklo_epi16(glyph, high));
+				_mm_storeu_si128((__m128i *)(row + x + 12), _mm_unpackhi_epi16(glyph, high));
+			}
+#endif
+
+			for (; x < screenWidth; x++)
+			{
+				row[x].Char.UnicodeChar = PIXEL_UPPER_HALF;
+				row[x].Attributes = (WORD)(top[x] | (bottom[x] << 4));
+			}
+		}
+	}
+
+protected:
+	//Exposes a framebuffer with twice the rows of the screen, which replaces the screen contents before every
+	//presented frame. A font twice as tall as it is wide gives square pixels. Layers are blended over the pixels afterwards.
+	//Until the screen is constructed there are no pixels, and the pixel functions do nothing.
+	void SetHalfBlockMode(bool enabled)
+	{
+		halfBlockMode = enabled;
+
+		//Layers replace the screen only outside of half-block mode
+		if (activeLayer < 0)
+			SetLayer(-1);
+	}
+
+	bool IsHalfBlockMode()
+	{
+		return halfBlockMode;
+	}
+
+	int GetPixelBufferWidth()
+	{
+		return screenWidth;
+	}
+
+	int GetPixelBufferHeight()
+	{
+		return screenHeight * 2;
+	}
+
+	//Rows of GetPixelBufferWidth() pixels; every value must stay within 0-15. Null before the screen is constructed.
+	BYTE *GetPixelBuffer()
+	{
+		return halfBlockPixels.empty() ? nullptr : halfBlockPixels.data();
+	}
+
+	//Colors are foreground colors (FG_*)
+	void DrawPixel(int x, int y, short color = FG_WHITE)
+	{
+		if (!halfBlockPixels.empty() && x >= 0 && x < screenWidth && y >= 0 && y < screenHeight * 2)
+			halfBlockPixels[screenWidth * y + x] = (BYTE)(color & 0x0F);
+	}
+
+	short GetPixel(int x, int y)
+	{
+		if (!halfBlockPixels.empty() && x >= 0 && x < screenWidth && y >= 0 && y < screenHeight * 2)
+			return halfBlockPixels[screenWidth * y + x];
+
+		return FG_BLACK;
+	}
+
+	void FillPixels(int x1, int y1, int x2, int y2, short color = FG_WHITE)
+	{
+		if (x1 > x2) std::swap(x1, x2);
+		if (y1 > y2) std::swap(y1, y2);
+
+		x1 = max(x1, 0);
+		y1 = max(y1, 0);
+		x2 = min(x2, screenWidth - 1);
+		y2 = min(y2, screenHeight * 2 - 1);
+
+		if (halfBlockPixels.empty() || x1 > x2 || y1 > y2)
+			return;
+
+		for (int y = y1; y <= y2; y++)
+			memset(halfBlockPixels.data() + screenWidth * y + x1, color & 0x0F, x2 - x1 + 1);
+	}
+
+	void ClearPixels(short color = FG_BLACK)
+	{
+		if (!halfBlockPixels.empty())
+			memset(halfBlockPixels.data(), color & 0x0F, halfBlockPixels.size());
+	}
+
+	//////////////////////////////////// POST-PROCESSING ///////////////////////////////////////////
+
+public:
+	//Kernels get one row of the finished frame at a time and may change it in place. They see a copy of the screen,
+	//so effects don't pile up on games that draw over the previous frame.
+	typedef std::function<void(CHAR_INFO *row, int y, int width)> PostProcessKernel;
+
+	//Maps the colors of every cell through a table of the 256 foreground/background combinations, e.g. for palette cycling.
+	//A table lookup per cell is already faster than anything SSE2 can do without gathers.
+	class PaletteRemap
+	{
+	private:
+		WORD table[256];
+
+	public:
+		PaletteRemap()
+		{
+			Reset();
+		}
+
+		void Reset()
+		{
+			for (int i = 0; i < 256; i++)
+				table[i] = (WORD)i;
+		}
+
+		//Both colors include the foreground and the background
+		void Set(BYTE from, BYTE to)
+		{
+			table[from] = to;
+		}
+
+		void SetForeground(BYTE from, BYTE to)
+		{
+			for (int i = 0; i < 256; i++)
+			{
+				if ((i & 0x0F) == (from & 0x0F))
+					table[i] = (table[i] & 0xF0) | (to & 0x0F);
+			}
+		}
+
+		void SetBackground(BYTE from, BYTE to)
+		{
+			for (int i = 0; i < 256; i++)
+			{
+				if ((i & 0xF0) == (from & 0xF0))
+					table[i] = (table[i] & 0x0F) | (to & 0xF0);
+			}
+		}
+
+		void operator()(CHAR_INFO *row, int y, int width) const
+		{
+			for (int x = 0; x < width; x++)
+				row[x].Attributes = (row[x].Attributes & 0xFF00) | table[row[x].Attributes & 0xFF];
+		}
+	};
+
+	//Darkens the shade characters (PIXEL_QUARTER to PIXEL_SOLID) towards empty cells with an ordered dither over a
+	//Size * Size Bayer matrix, e.g. for fading out. Other characters are left alone.
+	template<int Size = 4>
+	class ShadeFade
+	{
+	private:
+		static_assert(Size == 2 || Size == 4 || Size == 8, "The Bayer matrix has to be 2x2, 4x4 or 8x8");
+
+		//Brightness as a 16.16 fixed-point number
+		int level = 1 << 16;
+
+		//Thresholds in 16.16 fixed point, every row repeated far enough that four consecutive ones can be loaded from any column
+		int thresholds[Size][Size + 3];
+
+		static constexpr int BayerValue(int x, int y, int size)
+		{
+			return (size == 1) ? 0 : 4 * BayerValue(x % (size / 2), y % (size / 2), size / 2) +
+				((y / (size / 2) == 0) ? ((x / (size / 2) == 0) ? 0 : 2) : ((x / (size / 2) == 0) ? 3 : 1));
+		}
+
+		static int GetShade(WORD glyph)
+		{
+			switch (glyph)
+			{
+				case PIXEL_QUARTER: return 1;
+				case PIXEL_HALF: return 2;
+				case PIXEL_THREEQUARTERS: return 3;
+				case PIXEL_SOLID: return 4;
+				default: return 0;
+			}
+		}
+
+	public:
+		ShadeFade(float brightness = 1.0f)
+		{
+			SetBrightness(brightness);
+
+			for (int y = 0; y < Size; y++)
+			{
+				for (int x = 0; x < Size + 3; x++)
+					thresholds[y][x] = ((2 * BayerValue(x % Size, y, Size) + 1) << 16) / (2 * Size * Size);
+			}
+		}
+
+		//From 0 (every shade becomes empty) to 1 (unchanged)
+		void SetBrightness(float brightness)
+		{
+			if (brightness < 0.0f)
+				brightness = 0.0f;
+			else if (brightness > 1.0f)
+				brightness = 1.0f;
+
+			level = (int)(brightness * 65536.0f);
+		}
+
+		void operator()(CHAR_INFO *row, int y, int width) const
+		{
+			static const WORD shades[5] = { L' ', PIXEL_QUARTER, PIXEL_HALF, PIXEL_THREEQUARTERS, PIXEL_SOLID };
+
+			const int *rowThresholds = thresholds[y % Size];
+			int x = 0;
+
+#ifdef CGE_SSE2
+			//A cell is 4 bytes: the character in the low half and the attributes in the high half
+			const __m128i glyphMask = _mm_set1_epi32(0xFFFF);
+			const __m128i space = _mm_set1_epi32(L' ');
+
+			__m128i shadeGlyphs[4];
+			__m128i shadeLevels[4];
+			__m128i shadeIndices[4];
+			for (int k = 0; k < 4; k++)
+			{
+				shadeGlyphs[k] = _mm_set1_epi32(shades[k + 1]);
+				shadeLevels[k] = _mm_set1_epi32((k + 1) * level);
+				shadeIndices[k] = _mm_set1_epi32(k + 1);
+			}
+
+			for (; x + 4 <= width; x += 4)
+			{
+				__m128i cells = _mm_loadu_si128((const __m128i*)(row + x));
+				__m128i glyphs = _mm_and_si128(cells, glyphMask);
+
+				//Scale the shade of every cell by the brightness
+				__m128i isShade = _mm_setzero_si128();
+				__m128i scaled = _mm_setzero_si128();
+				for (int k = 0; k < 4; k++)
+				{
+					__m128i match = _mm_cmpeq_epi32(glyphs, shadeGlyphs[k]);
+					isShade = _mm_or_si128(isShade, match);
+					scaled = _mm_or_si128(scaled, _mm_and_si128(match, shadeLevels[k]));
+				}
+
+				//The threshold decides whether the fraction rounds up or down
+				__m128i index = _mm_srli_epi32(_mm_add_epi32(scaled, _mm_loadu_si128((const __m128i*)(rowThresholds + x % Size))), 16);
+
+				__m128i glyph = _mm_andnot_si128(_mm_cmpgt_epi32(index, _mm_setzero_si128()), space);
+				for (int k = 0; k < 4; k++)
+					glyph = _mm_or_si128(glyph, _mm_and_si128(_mm_cmpeq_epi32(index, shadeIndices[k]), shadeGlyphs[k]));
+
+				__m128i shaded = _mm_or_si128(_mm_andnot_si128(glyphMask, cells), glyph);
+				_mm_storeu_si128((__m128i*)(row + x), _mm_or_si128(_mm_and_si128(isShade, shaded), _mm_andnot_si128(isShade, cells)));
+			}
+#endif
+
+			for (; x < width; x++)
+			{
+				int shade = GetShade(row[x].Char.UnicodeChar);
+				if (shade > 0)
+					row[x].Char.UnicodeChar = shades[(shade * level + rowThresholds[x % Size]) >> 16];
+			}
+		}
+	};
+
+private:
+	struct PostProcessStage
+	{
+		int id;
+		PostProcessKernel kernel;
+	};
+
+	std::vector<PostProcessStage> postProcessStages;
+	int nextPostProcessID = 0;
+	bool parallelPostProcess = false;
+
+	//Frame that is presented instead of the screen while there are kernels
+	CHAR_INFO *postProcessedScreen = nullptr;
+
+	//Returns the frame to present
+	const CHAR_INFO* ApplyPostProcess()
+	{
+		if (postProcessStages.empty())
+			return mainScreen;
+
+		if (postProcessedScreen == nullptr)
+			postProcessedScreen = AllocateCells(screenWidth * screenHeight);
+
+		auto processRow = [&](int y)
+		{
+			CHAR_INFO *row = postProcessedScreen + screenWidth * y;
+			memcpy(row, mainScreen + screenWidth * y, sizeof(CHAR_INFO) * screenWidth);
+
+			//Every kernel runs over the row while it is still in the cache
+			for (auto &stage : postProcessStages)
+				stage.kernel(row, y, screenWidth);
+		};
+
+		if (parallelPostProcess)
+			ParallelForRows(processRow);
+		else
+		{
+			for (int y = 0; y < screenHeight; y++)
+				processRow(y);
+		}
+
+		return postProcessedScreen;
+	}
+
+protected:
+	//Kernels run in the order they were added, after OnUpdate() and before the frame is presented. Returns an ID for
+	//RemovePostProcess(). Pass std::ref(kernel) to keep changing a kernel after adding it.
+	int AddPostProcess(PostProcessKernel kernel)
+	{
+		postProcessStages.push_back({ nextPostProcessID, kernel });
+		return nextPostProcessID++;
+	}
+
+	void RemovePostProcess(int id)
+	{
+		postProcessStages.erase(std::remove_if(postProcessStages.begin(), postProcessStages.end(),
+			[id](const PostProcessStage &stage) { return stage.id == id; }), postProcessStages.end());
+	}
+
+	void ClearPostProcess()
+	{
+		postProcessStages.clear();
+	}
+
+	//Splits the rows between the worker pool. Every kernel then has to be safe to call from several threads at once.
+	void SetParallelPostProcess(bool parallel)
+	{
+		parallelPostProcess = parallel;
+	}
+
+	//////////////////////////////////////// INPUT /////////////////////////////////////////////////
+
+public:
+	enum InputEventType
+	{
+		INPUT_KEY,			//A key or a mouse button went down or up
+		INPUT_MOUSE_MOVE,
+		INPUT_MOUSE_WHEEL,
+		INPUT_MOUSE_HWHEEL,
+		INPUT_RESIZE		//The console screen buffer changed size
+	};
+
+	struct InputEvent
+	{
+		InputEventType type = INPUT_KEY;
+
+		//Virtual key code; mouse buttons use VK_LBUTTON, VK_RBUTTON and VK_MBUTTON
+		short key = 0;
+		bool down = false;
+
+		short mouseX = 0;
+		short mouseY = 0;
+
+		//The raw delta reported by the console, WHEEL_DELTA per notch of a regular wheel and less for smooth scrolling ones.
+		//Positive when the wheel is rotated away from the user or to the right.
+		short wheelDelta = 0;
+
+		//New size of the screen buffer for resize events
+		short width = 0;
+		short height = 0;
+
+		//When the event was read from the console
+		std::chrono::steady_clock::time_point time;
+	};
+
+private:
+	//A key that was tapped between two frames is both pressed and released in the same frame
+	struct KeyState {
+		bool pressed = false;
+		bool held = false;
+		bool released = false;
+	} keys[256];
+
+	short mouseX = 0;
+	short mouseY = 0;
+
+	//Wheel rotation accumulated over the current frame
+	short mouseWheel = 0;
+	short mouseHWheel = 0;
+
+	//Every event read during the current frame, in the order the console reported them
+	std::vector<InputEvent> inputEvents;
+
+	struct TimedInputRecord
+	{
+		INPUT_RECORD record;
+		std::chrono::steady_clock::time_point time;
+	};
+
+	//The input thread timestamps console events as soon as they arrive and hands them to the game thread
+	bool inputThreadRequested = false;
+	std::atomic<bool> inputThreadActive = false;
+	std::thread inputThread;
+	RingBuffer<TimedInputRecord, 1024> inputRecords;
+
+	void ReadInput()
+	{
+		if (headless)
+			return;
+
+		for (auto &key : keys)
+		{
+			key.pressed = false;
+			key.released = false;
+		}
+
+		inputEvents.clear();
+		recordedInputEvents = 0;
+		mouseWheel = 0;
+		mouseHWheel = 0;
+
+		//Everything the input thread collected since the last frame is applied at once, so the state stays latched for the whole frame
+		if (inputThreadActive)
+		{
+			TimedInputRecord timed;
+			while (inputRecords.Pop(timed))
+			{
+				HandleInputRecord(timed.record, timed.time);
+
+				if (profilerEnabled)
+					phaseHistory[PHASE_INPUT_LATENCY].Add(ToMilliseconds(std::chrono::steady_clock::now() - timed.time));
+			}
+			return;
+		}
+
+		//Keep reading until the console has no events left, however many arrived since the last frame
+		const DWORD bufferSize = 64;
+		INPUT_RECORD inputBuffer[bufferSize];
+		DWORD events = 0;
+
+		while (GetNumberOfConsoleInputEvents(consoleInput, &events) && events > 0)
+		{
+			if (!ReadConsoleInput(consoleInput, inputBuffer, min(events, bufferSize), &events) || events == 0)
+				break;
+
+			auto time = std::chrono::steady_clock::now();
+			for (DWORD i = 0; i < events; i++)
+				HandleInputRecord(inputBuffer[i], time);
+		}
+	}
+
+	void HandleInputRecord(const INPUT_RECORD &record, std::chrono::steady_clock::time_point time)
+	{
+		switch (record.EventType)
+		{
+			case KEY_EVENT:
+			{
+				const KEY_EVENT_RECORD &keyEvent = record.Event.KeyEvent;
+				bool down = keyEvent.bKeyDown != FALSE;
+
+				SetKey(keyEvent.wVirtualKeyCode, down, time);
+
+				//The console only reports generic modifiers, so the sided ones are derived from the scan code and flags
+				switch (keyEvent.wVirtualKeyCode)
+				{
+					case VK_SHIFT:
+						SetKey(keyEvent.wVirtualScanCode == 0x36 ? VK_RSHIFT : VK_LSHIFT, down, time);
+						break;
+					case VK_CONTROL:
+						SetKey((keyEvent.dwControlKeyState & ENHANCED_KEY) ? VK_RCONTROL : VK_LCONTROL, down, time);
+						break;
+					case VK_MENU:
+						SetKey((keyEvent.dwControlKeyState & ENHANCED_KEY) ? VK_RMENU : VK_LMENU, down, time);
+						break;
+				}
+				break;
+			}
+
+			case MOUSE_EVENT:
+			{
+				const MOUSE_EVENT_RECORD &mouseEvent = record.Event.MouseEvent;
+
+				if (mouseEvent.dwMousePosition.X != mouseX || mouseEvent.dwMousePosition.Y != mouseY)
+				{
+					mouseX = mouseEvent.dwMousePosition.X;
+					mouseY = mouseEvent.dwMousePosition.Y;
+
+					InputEvent event;
+					event.type = INPUT_MOUSE_MOVE;
+					event.mouseX = mouseX;
+					event.mouseY = mouseY;
+					event.time = time;
+					inputEvents.push_back(event);
+				}
+
+				if (mouseEvent.dwEventFlags == MOUSE_WHEELED || mouseEvent.dwEventFlags == MOUSE_HWHEELED)
+				{
+					bool horizontal = mouseEvent.dwEventFlags == MOUSE_HWHEELED;
+					short delta = (short)HIWORD(mouseEvent.dwButtonState);
+
+					if (horizontal)
+						mouseHWheel += delta;
+					else
+						mouseWheel += delta;
+
+					InputEvent event;
+					event.type = horizontal ? INPUT_MOUSE_HWHEEL : INPUT_MOUSE_WHEEL;
+					event.mouseX = mouseX;
+					event.mouseY = mouseY;
+					event.wheelDelta = delta;
+					event.time = time;
+					inputEvents.push_back(event);
+				}
+
+				//Wheel events keep the scroll distance in the high word
+				DWORD buttons = mouseEvent.dwButtonState & 0xFFFF;
+				SetKey(VK_LBUTTON, (buttons & FROM_LEFT_1ST_BUTTON_PRESSED) != 0, time);
+				SetKey(VK_RBUTTON, (buttons & RIGHTMOST_BUTTON_PRESSED) != 0, time);
+				SetKey(VK_MBUTTON, (buttons & FROM_LEFT_2ND_BUTTON_PRESSED) != 0, time);
+				break;
+			}
+
+			case WINDOW_BUFFER_SIZE_EVENT:
+			{
+				InputEvent event;
+				event.type = INPUT_RESIZE;
+				event.width = record.Event.WindowBufferSizeEvent.dwSize.X;
+				event.height = record.Event.WindowBufferSizeEvent.dwSize.Y;
+				event.time = time;
+				inputEvents.push_back(event);
+				break;
+			}
+
+			case FOCUS_EVENT:
+			{
+				//Keys released while the console is out of focus are never reported, so they would stay held
+				if (!record.Event.FocusEvent.bSetFocus)
+				{
+					for (int i = 0; i < 256; i++)
+						SetKey(i, false, time);
+				}
+				break;
+			}
+		}
+	}
+
+	void SetKey(int key, bool down, std::chrono::steady_clock::time_point time)
+	{
+		if (key < 0 || key >= 256)
+			return;
+
+		//Auto-repeat reports the key as going down again while it is still held
+		KeyState &state = keys[key];
+		if (state.held == down)
+			return;
+
+		if (down)
+			state.pressed = true;
+		else
+			state.released = true;
+
+		state.held = down;
+
+		InputEvent event;
+		event.type = INPUT_KEY;
+		event.key = (short)key;
+		event.down = down;
+		event.mouseX = mouseX;
+		event.mouseY = mouseY;
+		event.time = time;
+		inputEvents.push_back(event);
+	}
+
+	void StartInputThread()
+	{
+		inputThreadActive = true;
+		inputThread = std::thread(&ConsoleGameEngine::InputThread, this);
+	}
+
+	void StopInputThread()
+	{
+		if (!inputThreadActive)
+			return;
+
+		inputThreadActive = false;
+		if (inputThread.joinable())
+			inputThread.join();
+	}
+
+	void InputThread()
+	{
+		const DWORD bufferSize = 64;
+		INPUT_RECORD inputBuffer[bufferSize];
+
+		while (inputThreadActive)
+		{
+			//Wake up regularly to notice when the thread should stop
+			if (WaitForSingleObject(consoleInput, 10) != WAIT_OBJECT_0)
+				continue;
+
+			DWORD events = 0;
+			if (!GetNumberOfConsoleInputEvents(consoleInput, &events) || events == 0)
+				continue;
+
+			if (!ReadConsoleInput(consoleInput, inputBuffer, min(events, bufferSize), &events))
+				continue;
+
+			TimedInputRecord timed;
+			timed.time = std::chrono::steady_clock::now();
+
+			for (DWORD i = 0; i < events; i++)
+			{
+				timed.record = inputBuffer[i];
+
+				//A full queue means the game thread is stalled; wait for it instead of losing the event
+				while (!inputRecords.Push(timed) && inputThreadActive)
+					std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+		}
+	}
+
+protected:
+	//Reads the console on a separate thread, which timestamps events as soon as they arrive. Has to be called before Start().
+	void EnableInputThread(bool enable = true)
+	{
+		inputThreadRequested = enable;
+	}
+
+	short GetMouseX()
+	{
+		return mouseX;
+	}
+
+	short GetMouseY()
+	{
+		return mouseY;
+	}
+
+	KeyState GetKey(short key)
+	{
+		return keys[key];
+	}
+
+	//Vertical wheel rotation during the current frame, as the sum of the raw deltas.
+	//A regular wheel reports WHEEL_DELTA per notch, while smooth scrolling ones report fractions of it.
+	short GetMouseWheel()
+	{
+		return mouseWheel;
+	}
+
+	//Horizontal wheel rotation during the current frame, in the same units as GetMouseWheel()
+	short GetMouseHWheel()
+	{
+		return mouseHWheel;
+	}
+
+	//Events of the current frame, for games that need the exact order or timing of the input
+	const std::vector<InputEvent>& GetInputEvents() const
+	{
+		return inputEvents;
+	}
+
+	//////////////////////////////////////// AUDIO /////////////////////////////////////////////////
+
+public:
+	//Interpolation used when a clip is played at a different rate than the one of the device
+	enum Resampler
+	{
+		RESAMPLE_NEAREST,
+		RESAMPLE_LINEAR,
+		RESAMPLE_SINC	//Windowed sinc with 8 taps
+	};
+
+	enum AudioBackendType
+	{
+		AUDIO_BACKEND_WAVEOUT,
+		AUDIO_BACKEND_WASAPI_SHARED,
+		AUDIO_BACKEND_WASAPI_EXCLUSIVE
+	};
+
+	//Device that plays the blocks of 16-bit interleaved samples produced by the mixer.
+	//Open() and Close() are called by the thread that starts and destroys audio, while the audio thread isn't running.
+	//AcquireBlock(), SubmitBlock(), GetLatency() and GetUnderruns() are only called by the audio thread;
+	//Wake(), Flush() and SetVolume() may be called by the game thread at any time while the device is open.
+	class AudioBackend
+	{
+	public:
+		virtual ~AudioBackend() {}
+
+		//May change the number of frames per block to one the device works with
+		virtual bool Open(int samplesPerSec, int channels, int blockCount, int &framesPerBlock) = 0;
+		virtual void Close() = 0;
+
+		//Called by the audio thread before its first block and after its last one, e.g. to set up COM for it
+		virtual void BeginThread() {}
+		virtual void EndThread() {}
+
+		//Waits until the device can take another block and returns the memory to mix it into.
+		//Returns nullptr if the wait timed out or was interrupted by Wake().
+		virtual short* AcquireBlock() = 0;
+		virtual void SubmitBlock() = 0;
+
+		virtual void Wake() = 0;
+
+		//Discards the samples that are queued but haven't been played yet
+		virtual void Flush() {}
+
+		//Volume in the format of waveOutSetVolume(), the left channel in the low word and the right one in the high word
+		virtual void SetVolume(DWORD volume) = 0;
+
+		//Milliseconds between submitting a block and hearing its first sample
+		virtual float GetLatency() = 0;
+
+		//Number of times the device ran out of samples to play
+		virtual int GetUnderruns() = 0;
+	};
+
+	//All times are in milliseconds
+	struct AudioStats
+	{
+		float latency = 0.0f;
+		float mixTime = 0.0f;	//Average over the recent blocks
+		int underruns = 0;
+		int framesPerBlock = 0;
+	};
+
+private:
+	//Queues the blocks to waveOut, with every header prepared once when the device is opened
+	class WaveOutBackend : public AudioBackend
+	{
+	private:
+		HWAVEOUT device = 0;
+
+		int samplesPerSec = 0;
+		int channels = 0;
+		int blockCount = 0;
+		int framesPerBlock = 0;
+
+		std::vector<short> samples;
+		std::vector<WAVEHDR> blocks;
+
+		int currentBlock = 0;
+		std::atomic<int> freeBlocks = 0;
+
+		std::mutex writingBlock;
+		std::condition_variable blockWritten;
+
+		std::atomic<bool> woken = false;
+		std::atomic<bool> playing = false;
+		int underruns = 0;
+
+		//Static wrapper for the callback function because Microsoft
+		//(callback cannot be method of the class itself, but it may be called via dwInstance)
+		static void CALLBACK waveOutProcWrapper(HWAVEOUT hwo, UINT uMsg, DWORD_PTR dwInstance, DWORD_PTR dwParam1, DWORD_PTR dwParam2)
+		{
+			((WaveOutBackend*)dwInstance)->waveOutProc(hwo, uMsg, dwParam1, dwParam2);
+		}
+
+		//The actual callback function
+		void waveOutProc(HWAVEOUT hwo, UINT uMsg, DWORD_PTR dwParam1, DWORD_PTR dwParam2)
+		{
+			if (uMsg == WOM_DONE)
+			{
+				freeBlocks++;
+				std::unique_lock<std::mutex> lock(writingBlock);
+				blockWritten.notify_one();
+			}
+		}
+
+	public:
+		~WaveOutBackend()
+		{
+			Close();
+		}
+
+		bool Open(int samplesPerSec, int channels, int blockCount, int &framesPerBlock) override
+		{
+			Close();
+
+			this->samplesPerSec = samplesPerSec;
+			this->channels = channels;
+			this->blockCount = blockCount;
+			this->framesPerBlock = framesPerBlock;
+
+			WAVEFORMATEX format;
+			format.wFormatTag = WAVE_FORMAT_PCM;
+			format.nChannels = channels;
+			format.nSamplesPerSec = samplesPerSec;
+			format.wBitsPerSample = sizeof(short) * 8;
+			format.nBlockAlign = format.nChannels * (format.wBitsPerSample / 8);
+			format.nAvgBytesPerSec = format.nSamplesPerSec * format.nBlockAlign;
+			format.cbSize = 0;
+
+			if (waveOutOpen(&device, WAVE_MAPPER, &format, (DWORD_PTR)waveOutProcWrapper, (DWORD_PTR)this, CALLBACK_FUNCTION) != S_OK)
+			{
+				device = 0;
+				return false;
+			}
+
+			samples.assign((size_t)blockCount * framesPerBlock * channels, 0);
+			blocks.assign(blockCount, WAVEHDR());
+
+			//Make each block point to a particular position in the buffer of samples. The headers stay prepared
+			//until the device is closed, so that a finished block can be written again right away.
+			for (int i = 0; i < blockCount; i++)
+			{
+				blocks[i].lpData = (LPSTR)(samples.data() + (size_t)i * framesPerBlock * channels);
+				blocks[i].dwBufferLength = (DWORD)(sizeof(short) * framesPerBlock * channels);
+				waveOutPrepareHeader(device, &blocks[i], sizeof(WAVEHDR));
+			}
+
+			currentBlock = 0;
+			freeBlocks = blockCount;
+			woken = false;
+			playing = false;
+			underruns = 0;
+
+			return true;
+		}
+
+		void Close() override
+		{
+			if (device == 0)
+				return;
+
+			waveOutSetVolume(device, MAKELONG(MAX_VOLUME, MAX_VOLUME));
+
+			//Returns all blocks, after which they can be unprepared
+			waveOutReset(device);
+			for (WAVEHDR &block : blocks)
+				waveOutUnprepareHeader(device, &block, sizeof(WAVEHDR));
+
+			waveOutClose(device);
+			device = 0;
+
+			blocks.clear();
+			samples.clear();
+		}
+
+		short* AcquireBlock() override
+		{
+			//Wait for the soundcard to request a block of audio samples
+			if (freeBlocks == 0)
+			{
+				std::unique_lock<std::mutex> lock(writingBlock);
+				blockWritten.wait_for(lock, std::chrono::milliseconds(100), [this]() { return freeBlocks > 0 || woken; });
+				woken = false;
+
+				if (freeBlocks == 0)
+					return nullptr;
+			}
+
+			//Every block that was written has been played, so the device had nothing left to play
+			if (playing && freeBlocks == blockCount)
+				underruns++;
+
+			//Use the block
+			freeBlocks--;
+			return samples.data() + (size_t)currentBlock * framesPerBlock * channels;
+		}
+
+		void SubmitBlock() override
+		{
+			waveOutWrite(device, &blocks[currentBlock], sizeof(WAVEHDR));
+			playing = true;
+
+			currentBlock++;
+			currentBlock %= blockCount;
+		}
+
+		void Wake() override
+		{
+			woken = true;
+			std::unique_lock<std::mutex> lock(writingBlock);
+			blockWritten.notify_one();
+		}
+
+		void Flush() override
+		{
+			//The device goes quiet on purpose, which shouldn't count as running out of samples
+			playing = false;
+			waveOutReset(device);
+		}
+
+		void SetVolume(DWORD volume) override
+		{
+			waveOutSetVolume(device, volume);
+		}
+
+		float GetLatency() override
+		{
+			return (float)((blockCount - freeBlocks) * framesPerBlock) * 1000.0f / (float)samplesPerSec;
+		}
+
+		int GetUnderruns() override
+		{
+			return underruns;
+		}
+	};
+
+	//Event-driven WASAPI stream on the default render device. In shared mode up to blockCount blocks are queued
+	//in the buffer of the stream; in exclusive mode a block is the whole buffer and its size is picked by the device.
+	class WasapiBackend : public AudioBackend
+	{
+	private:
+		bool exclusive = false;
+
+		IMMDevice *device = nullptr;
+		IAudioClient *client = nullptr;
+		IAudioRenderClient *renderClient = nullptr;
+		HANDLE bufferEvent = NULL;
+		bool comInitialized = false;
+		bool threadComInitialized = false;
+
+		int samplesPerSec = 0;
+		int channels = 0;
+		int framesPerBlock = 0;
+		UINT32 bufferFrames = 0;
+		REFERENCE_TIME streamLatency = 0;
+
+		short *block = nullptr;
+		bool playing = false;
+		int underruns = 0;
+		float latency = 0.0f;
+
+		std::atomic<bool> woken = false;
+
+		//Applied to the samples, since exclusive streams have no volume control of their own.
+		//The left gain goes to the even channels and the right one to the odd channels.
+		std::atomic<float> leftGain = 1.0f;
+		std::atomic<float> rightGain = 1.0f;
+
+		short* GetBlock(UINT32 padding)
+		{
+			//Exclusive streams hand over the whole buffer on every event, so an empty one is the normal case there
+			if (playing && !exclusive && padding == 0)
+				underruns++;
+
+			BYTE *data = nullptr;
+			HRESULT result = renderClient->GetBuffer((UINT32)framesPerBlock, &data);
+			if (FAILED(result))
+			{
+				//Exclusive streams report a buffer that was missed by the time the thread got to it
+				if (result == AUDCLNT_E_BUFFER_ERROR)
+					underruns++;
+
+				//Either the device is gone or a stream that failed to start has filled its buffer.
+				//Wait instead of spinning, and try to start the stream again.
+				WaitForSingleObject(bufferEvent, 100);
+				if (!playing)
+					playing = SUCCEEDED(client->Start());
+				return nullptr;
+			}
+
+			block = (short*)data;
+			return block;
+		}
+
+		static REFERENCE_TIME ToReferenceTime(int frames, int samplesPerSec)
+		{
+			//In units of 100 nanoseconds
+			return (REFERENCE_TIME)(10000000.0 * (double)frames / (double)samplesPerSec + 0.5);
+		}
+
+		bool CreateClient(const WAVEFORMATEX &format, int blockCount)
+		{
+			if (FAILED(device->Activate(__uuidof(IAudioClient), CLSCTX_ALL, NULL, (void**)&client)))
+				return false;
+
+			REFERENCE_TIME period = ToReferenceTime(framesPerBlock, samplesPerSec);
+			if (!exclusive)
+				return SUCCEEDED(client->Initialize(AUDCLNT_SHAREMODE_SHARED, AUDCLNT_STREAMFLAGS_EVENTCALLBACK | AUDCLNT_STREAMFLAGS_AUTOCONVERTPCM | AUDCLNT_STREAMFLAGS_SRC_DEFAULT_QUALITY, period * blockCount, 0, &format, NULL));
+
+			HRESULT result = client->Initialize(AUDCLNT_SHAREMODE_EXCLUSIVE, AUDCLNT_STREAMFLAGS_EVENTCALLBACK, period, period, &format, NULL);
+			if (result == AUDCLNT_E_BUFFER_SIZE_NOT_ALIGNED)
+			{
+				//Retry with the closest period the device supports, which takes a new client
+				UINT32 alignedFrames = 0;
+				client->GetBufferSize(&alignedFrames);
+				client->Release();
+				client = nullptr;
+
+				if (FAILED(device->Activate(__uuidof(IAudioClient), CLSCTX_ALL, NULL, (void**)&client)))
+					return false;
+
+				period = ToReferenceTime((int)alignedFrames, samplesPerSec);
+				result = client->Initialize(AUDCLNT_SHAREMODE_EXCLUSIVE, AUDCLNT_STREAMFLAGS_EVENTCALLBACK, period, period, &format, NULL);
+			}
+
+			return SUCCEEDED(result);
+		}
+
+	public:
+		WasapiBackend(bool exclusive) : exclusive(exclusive) {}
+
+		~WasapiBackend()
+		{
+			Close();
+		}
+
+		bool Open(int samplesPerSec, int channels, int blockCount, int &framesPerBlock) override
+		{
+			Close();
+
+			this->samplesPerSec = samplesPerSec;
+			this->channels = channels;
+			this->framesPerBlock = framesPerBlock;
+
+			//If the thread is already in a single-threaded apartment COM is still usable, it just mustn't be uninitialized here.
+			//The audio thread joins the multithreaded apartment by itself in BeginThread().
+			comInitialized = SUCCEEDED(CoInitializeEx(NULL, COINIT_MULTITHREADED));
+
+			IMMDeviceEnumerator *enumerator = nullptr;
+			if (FAILED(CoCreateInstance(__uuidof(MMDeviceEnumerator), NULL, CLSCTX_ALL, __uuidof(IMMDeviceEnumerator), (void**)&enumerator)))
+			{
+				Close();
+				return false;
+			}
+
+			HRESULT result = enumerator->GetDefaultAudioEndpoint(eRender, eConsole, &device);
+			enumerator->Release();
+
+			WAVEFORMATEX format;
+			format.wFormatTag = WAVE_FORMAT_PCM;
+			format.nChannels = channels;
+			format.nSamplesPerSec = samplesPerSec;
+			format.wBitsPerSample = sizeof(short) * 8;
+			format.nBlockAlign = format.nChannels * (format.wBitsPerSample / 8);
+			format.nAvgBytesPerSec = format.nSamplesPerSec * format.nBlockAlign;
+			format.cbSize = 0;
+
+			if (FAILED(result) || !CreateClient(format, blockCount))
+			{
+				Close();
+				return false;
+			}
+
+			bufferEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+			if (bufferEvent == NULL || FAILED(client->SetEventHandle(bufferEvent)) || FAILED(client->GetBufferSize(&bufferFrames)) ||
+				FAILED(client->GetService(__uuidof(IAudioRenderClient), (void**)&renderClient)))
+			{
+				Close();
+				return false;
+			}
+
+			client->GetStreamLatency(&streamLatency);
+
+			if (exclusive || (UINT32)this->framesPerBlock > bufferFrames)
+				this->framesPerBlock = (int)bufferFrames;
+			framesPerBlock = this->framesPerBlock;
+
+			block = nullptr;
+			playing = false;
+			underruns = 0;
+			latency = 0.0f;
+			woken = false;
+			leftGain = 1.0f;
+			rightGain = 1.0f;
+
+			return true;
+		}
+
+		void Close() override
+		{
+			if (client != nullptr)
+				client->Stop();
+
+			if (renderClient != nullptr) renderClient->Release();
+			if (client != nullptr) client->Release();
+			if (device != nullptr) device->Release();
+			renderClient = nullptr;
+			client = nullptr;
+			device = nullptr;
+
+			if (bufferEvent != NULL)
+				CloseHandle(bufferEvent);
+			bufferEvent = NULL;
+
+			if (comInitialized)
+				CoUninitialize();
+			comInitialized = false;
+		}
+
+		void BeginThread() override
+		{
+			threadComInitialized = SUCCEEDED(CoInitializeEx(NULL, COINIT_MULTITHREADED));
+		}
+
+		void EndThread() override
+		{
+			if (threadComInitialized)
+				CoUninitialize();
+			threadComInitialized = false;
+		}
+
+		short* AcquireBlock() override
+		{
+			while (true)
+			{
+				UINT32 padding = 0;
+				if (FAILED(client->GetCurrentPadding(&padding)))
+				{
+					//The device is gone; avoid spinning until audio is destroyed
+					WaitForSingleObject(bufferEvent, 100);
+					return nullptr;
+				}
+
+				//A stream that hasn't started yet is filled right away. After that, shared streams take a block
+				//whenever there is room for one, while exclusive streams take the whole buffer on every event.
+				if (!playing || (!exclusive && bufferFrames - padding >= (UINT32)framesPerBlock))
+					return GetBlock(padding);
+
+				if (WaitForSingleObject(bufferEvent, 100) != WAIT_OBJECT_0 || woken.exchange(false))
+					return nullptr;
+
+				if (exclusive && SUCCEEDED(client->GetCurrentPadding(&padding)))
+					return GetBlock(padding);
+			}
+		}
+
+		void SubmitBlock() override
+		{
+			float volumes[2] = { leftGain, rightGain };
+			if (volumes[0] != 1.0f || volumes[1] != 1.0f)
+			{
+				for (int i = 0; i < framesPerBlock * channels; i++)
+					block[i] = (short)((float)block[i] * volumes[(i % channels) & 1]);
+			}
+
+			renderClient->ReleaseBuffer((UINT32)framesPerBlock, 0);
+			block = nullptr;
+
+			if (!playing)
+				playing = SUCCEEDED(client->Start());
+
+			UINT32 padding = 0;
+			client->GetCurrentPadding(&padding);
+			latency = (float)padding * 1000.0f / (float)samplesPerSec + (float)streamLatency / 10000.0f;
+		}
+
+		void Wake() override
+		{
+			woken = true;
+			SetEvent(bufferEvent);
+		}
+
+		void SetVolume(DWORD volume) override
+		{
+			//The low word is the left channel and the high word the right one, as with waveOut
+			leftGain = (float)(volume & 0xFFFF) / (float)0xFFFF;
+			rightGain = (float)(volume >> 16) / (float)0xFFFF;
+		}
+
+		float GetLatency() override
+		{
+			return latency;
+		}
+
+		int GetUnderruns() override
+		{
+			return underruns;
+		}
+	};
+
+	class AudioClip
+	{
+	public:
+		WAVEFORMATEX format;
+		float *data = nullptr;
+
+		//Streamed clips keep no decoded copy and read 16-bit samples straight from the memory-mapped file instead
+		const short *streamedData = nullptr;
+		const void *fileView = nullptr;
+
+		long length;
+
+		bool isValid = false;
+
+		//Path the clip is cached under and the number of loads sharing it. Only accessed by the game thread.
+		std::wstring fileName;
+		int references = 1;
+
+		//Set by the mixer once it no longer refers to an unloaded clip
+		std::atomic<bool> released = false;
+
+		AudioClip() {}
+
+		AudioClip(const AudioClip&) = delete;
+		AudioClip& operator=(const AudioClip&) = delete;
+
+		~AudioClip()
+		{
+			delete[] data;
+
+			if (fileView != nullptr)
+				UnmapViewOfFile(fileView);
+		}
+
+		bool OpenStream(std::wstring fileName)
+		{
+			HANDLE file = CreateFile(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+			if (file == INVALID_HANDLE_VALUE) return false;
+
+			LARGE_INTEGER fileSize;
+			HANDLE mapping = NULL;
+			if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0)
+				mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+
+			//The view keeps the mapping and the file open by itself
+			CloseHandle(file);
+			if (mapping == NULL) return false;
+
+			fileView = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+			CloseHandle(mapping);
+			if (fileView == nullptr) return false;
+
+			const BYTE *samples = nullptr;
+			DWORD samplesSize = 0;
+			if (!ParseWave((const BYTE*)fileView, (size_t)fileSize.QuadPart, format, samples, samplesSize))
+				return false;
+
+			//Only 16-bit PCM can be played directly from the file
+			if (format.wFormatTag != WAVE_FORMAT_PCM || format.wBitsPerSample != 16 || format.nChannels == 0)
+				return false;
+
+			length = samplesSize / (format.nChannels * sizeof(short));
+			streamedData = (const short*)samples;
+			isValid = true;
+
+			return true;
+		}
+
+		//Locates the format and the samples of a .wav file that is stored in memory
+		static bool ParseWave(const BYTE *bytes, size_t size, WAVEFORMATEX &format, const BYTE *&samples, DWORD &samplesSize)
+		{
+			if (size < 12 || memcmp(bytes, "RIFF", 4) != 0 || memcmp(bytes + 8, "WAVE", 4) != 0)
+				return false;
+
+			bool formatFound = false;
+			size_t offset = 12;
+
+			//Walk through the subchunks; the format has to come before the samples
+			while (offset + 8 <= size)
+			{
+				const BYTE *chunk = bytes + offset;
+				DWORD chunkSize;
+				memcpy(&chunkSize, chunk + 4, sizeof(DWORD));
+
+				size_t available = size - offset - 8;
+				if (chunkSize > available)
+					chunkSize = (DWORD)available;
+
+				if (memcmp(chunk, "fmt ", 4) == 0)
+				{
+					//WAVEFORMATEX takes 2 additional bytes of data that may not be present in .wav files
+					if (chunkSize < sizeof(WAVEFORMATEX) - 2)
+						return false;
+
+					SecureZeroMemory(&format, sizeof(WAVEFORMATEX));
+					memcpy(&format, chunk + 8, sizeof(WAVEFORMATEX) - 2);
+
+					//Extensible formats store the actual format tag in the first two bytes of the subformat GUID
+					if (format.wFormatTag == WAVE_FORMAT_EXTENSIBLE && chunkSize >= 26)
+						memcpy(&format.wFormatTag, chunk + 8 + 24, sizeof(WORD));
+
+					formatFound = true;
+				}
+				else if (memcmp(chunk, "data", 4) == 0)
+				{
+					if (!formatFound)
+						return false;
+
+					samples = chunk + 8;
+					samplesSize = chunkSize;
+					return true;
+				}
+
+				//Chunks are aligned to two bytes
+				offset += 8 + chunkSize + (chunkSize & 1);
+			}
+
+			return false;
+		}
+
+		//Decodes the whole file up front. 8-bit and 16-bit PCM as well as 32-bit float files are supported.
+		AudioClip(std::wstring fileName)
+		{
+			HANDLE file = CreateFile(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+			if (file == INVALID_HANDLE_VALUE) return;
+
+			//The file is read with a single call and parsed in memory
+			std::vector<BYTE> bytes;
+			DWORD bytesRead = 0;
+
+			LARGE_INTEGER fileSize;
+			if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0 && fileSize.QuadPart <= MAXDWORD)
+			{
+				bytes.resize((size_t)fileSize.QuadPart);
+				if (!ReadFile(file, bytes.data(), (DWORD)bytes.size(), &bytesRead, NULL))
+					bytesRead = 0;
+			}
+
+			CloseHandle(file);
+
+			const BYTE *samples = nullptr;
+			DWORD samplesSize = 0;
+			if (!ParseWave(bytes.data(), bytesRead, format, samples, samplesSize))
+				return;
+
+			int bytesPerSample = format.wBitsPerSample / 8;
+			bool pcm = format.wFormatTag == WAVE_FORMAT_PCM && (bytesPerSample == 1 || bytesPerSample == 2);
+			bool ieee = format.wFormatTag == WAVE_FORMAT_IEEE_FLOAT && bytesPerSample == 4;
+			if (!(pcm || ieee) || format.nChannels == 0)
+				return;
+
+			length = samplesSize / (format.nChannels * bytesPerSample);
+			long count = length * format.nChannels;
+			data = new float[count];
+
+			if (ieee)
+				memcpy(data, samples, count * sizeof(float));
+			else if (bytesPerSample == 2)
+				ConvertFromPCM16(samples, data, count);
+			else
+				ConvertFromPCM8(samples, data, count);
+
+			isValid = true;
+		}
+
+		//Normalizes the samples the same way the mixer does for streamed clips
+		static void ConvertFromPCM16(const BYTE *source, float *destination, long count)
+		{
+			long i = 0;
+
+#ifdef CGE_SSE2
+			const __m128 scale = _mm_set1_ps((float)MAXSHORT);
+
+			for (; i + 8 <= count; i += 8)
+			{
+				__m128i samples = _mm_loadu_si128((const __m128i*)(source + i * 2));
+
+				//Duplicating every sample into both halves of a 32-bit lane and shifting it back sign-extends it
+				__m128i low = _mm_srai_epi32(_mm_unpacklo_epi16(samples, samples), 16);
+				__m128i high = _mm_srai_epi32(_mm_unpackhi_epi16(samples, samples), 16);
+
+				_mm_storeu_ps(destination + i, _mm_div_ps(_mm_cvtepi32_ps(low), scale));
+				_mm_storeu_ps(destination + i + 4, _mm_div_ps(_mm_cvtepi32_ps(high), scale));
+			}
+#endif
+
+			for (; i < count; i++)
+			{
+				short sample;
+				memcpy(&sample, source + i * 2, sizeof(short));
+				destination[i] = (float)sample / (float)MAXSHORT;
+			}
+		}
+
+		//8-bit samples are unsigned and centered around 128
+		static void ConvertFromPCM8(const BYTE *source, float *destination, long count)
+		{
+			long i = 0;
+
+#ifdef CGE_SSE2
+			const __m128i zero = _mm_setzero_si128();
+			const __m128i center = _mm_set1_epi16(128);
+			const __m128 scale = _mm_set1_ps(1.0f / 128.0f);
+
+			for (; i + 16 <= count; i += 16)
+			{
+				__m128i samples = _mm_loadu_si128((const __m128i*)(source + i));
+				__m128i words[2] =
+				{
+					_mm_sub_epi16(_mm_unpacklo_epi8(samples, zero), center),
+					_mm_sub_epi16(_mm_unpackhi_epi8(samples, zero), center)
+				};
+
+				for (int k = 0; k < 2; k++)
+				{
+					__m128i low = _mm_srai_epi32(_mm_unpacklo_epi16(words[k], words[k]), 16);
+					__m128i high = _mm_srai_epi32(_mm_unpackhi_epi16(words[k], words[k]), 16);
+
+					_mm_storeu_ps(destination + i + k * 8, _mm_mul_ps(_mm_cvtepi32_ps(low), scale));
+					_mm_storeu_ps(destination + i + k * 8 + 4, _mm_mul_ps(_mm_cvtepi32_ps(high), scale));
+				}
+			}
+#endif
+
+			for (; i < count; i++)
+				destination[i] = (float)((int)source[i] - 128) / 128.0f;
+		}
+
+	};
+
+public:
+	//Result of an asynchronous load, see LoadAudioClipAsync
+	class AudioClipLoad
+	{
+	private:
+		friend class ConsoleGameEngine;
+
+		std::wstring fileName;
+		std::unique_ptr<AudioClip> clip;
+		std::atomic<bool> ready = false;
+
+		int id = -1;
+		bool registered = false;
+	};
+
+	typedef std::shared_ptr<AudioClipLoad> AudioClipHandle;
+
+private:
+
+	struct CurrentlyPlayingClip
+	{
+		int audioClipID = 0;
+		AudioClip *clip = nullptr;
+
+		//Position in frames as a 32.32 fixed-point number
+		unsigned long long position = 0;
+		float pitch = 1.0f;
+
+		bool looped = false;
+		bool paused = false;
+		bool finished = false;
+
+		CurrentlyPlayingClip() {}
+
+		CurrentlyPlayingClip(int id, AudioClip *clip, bool looped, float pitch) : audioClipID(id), clip(clip), pitch(pitch), looped(looped) {}
+
+		void Restart()
+		{
+			position = 0;
+			paused = false;
+			finished = false;
+		}
+	};
+
+	//Only accessed by the game thread. Clips are never moved, so the mixer may keep pointers to them.
+	std::vector<std::unique_ptr<AudioClip>> audioClips;
+
+	//Decoded clips by path, so loading the same file again shares the existing clip
+	std::unordered_map<std::wstring, int> audioClipCache;
+
+	//Unloaded clips wait here until the mixer has released them
+	std::vector<std::unique_ptr<AudioClip>> retiredAudioClips;
+
+	//Only accessed by the mixer (or by the game thread while the audio thread is not running)
+	std::vector<CurrentlyPlayingClip> currentlyPlayingClips;
+
+	//Interleaved block being mixed and the block of the clip currently being rendered
+	std::vector<float> mixBuffer;
+	std::vector<float> voiceBuffer;
+
+	enum AudioCommandType
+	{
+		AUDIO_PLAY,
+		AUDIO_PAUSE,
+		AUDIO_PAUSE_ALL,
+		AUDIO_RESTART,
+		AUDIO_RESTART_ALL,
+		AUDIO_STOP,
+		AUDIO_STOP_ALL,
+		AUDIO_SET_PITCH,
+		AUDIO_RELEASE
+	};
+
+	struct AudioCommand
+	{
+		AudioCommandType type = AUDIO_PLAY;
+		int audioClipID = 0;
+		AudioClip *clip = nullptr;
+		bool looped = false;
+		float value = 0.0f;
+	};
+
+	//Playback control calls are queued by the game thread and applied by the mixer at block boundaries
+	RingBuffer<AudioCommand, 256> audioCommands;
+
+	//Commands that didn't fit into the queue, only accessed by the game thread
+	std::vector<AudioCommand> deferredAudioCommands;
+
+	//Threads of LoadAudioClipAsync, joined once their load has been polled or when audio is destroyed
+	struct AudioClipLoader
+	{
+		AudioClipHandle handle;
+		std::thread thread;
+	};
+
+	std::vector<AudioClipLoader> audioClipLoaders;
+
+	void JoinAudioClipLoaders(const AudioClipLoad *finished = nullptr)
+	{
+		for (auto loader = audioClipLoaders.begin(); loader != audioClipLoaders.end();)
+		{
+			if (finished != nullptr && loader->handle.get() != finished)
+			{
+				loader++;
+				continue;
+			}
+
+			loader->thread.join();
+			loader = audioClipLoaders.erase(loader);
+		}
+	}
+
+	std::atomic<Resampler> resampler = RESAMPLE_LINEAR;
+
+	std::unique_ptr<AudioBackend> audioBackend;
+
+	int samplesPerSec = 0;
+	int channels = 0;
+	int framesPerBlock = 0;
+
+	std::atomic<bool> audioThreadActive = false;
+	std::thread audioThread;
+
+	std::atomic<float> globalTime = 0.0f;
+
+	bool soundMuted = false;
+	int currentVolume = MAX_VOLUME;
+
+	//Measured by the audio thread after every block
+	std::atomic<float> audioLatency = 0.0f;
+	std::atomic<float> audioMixTime = 0.0f;
+	std::atomic<int> audioUnderruns = 0;
+
+	void AudioThread()
+	{
+		float timeStep = 1.0f / (float)samplesPerSec;
+		int frames = framesPerBlock;
+
+		audioBackend->BeginThread();
+
+		while (audioThreadActive)
+		{
+			short *block = audioBackend->AcquireBlock();
+			if (block == nullptr)
+				continue;
+
+			ProcessAudioCommands();
+
+			auto mixStart = std::chrono::steady_clock::now();
+
+			MixBlock(mixBuffer.data(), frames, timeStep);
+			ConvertToPCM16(mixBuffer.data(), block, frames * channels);
+
+			globalTime = globalTime + (float)frames * timeStep;
+
+			auto mixDuration = std::chrono::steady_clock::now() - mixStart;
+			long long nanoseconds = (long long)std::chrono::duration_cast<std::chrono::nanoseconds>(mixDuration).count();
+
+			if (profilerEnabled)
+			{
+				audioMixNanoseconds += nanoseconds;
+				audioBlocksMixed++;
+			}
+
+			audioBackend->SubmitBlock();
+
+			//Exponential moving average, so that a single slow block doesn't dominate the reading
+			audioMixTime = audioMixTime + ((float)nanoseconds / 1000000.0f - audioMixTime) * 0.1f;
+			audioLatency = audioBackend->GetLatency();
+			audioUnderruns = audioBackend->GetUnderruns();
+		}
+
+		audioBackend->EndThread();
+	}
+
+	//Renders a block of interleaved samples from all playing clips and the user hooks
+	void MixBlock(float *output, int frames, float timeStep)
+	{
+		int samples = frames * channels;
+		memset(output, 0, sizeof(float) * samples);
+
+		for (auto &clip : currentlyPlayingClips)
+		{
+			if (clip.paused)
+				continue;
+
+			int rendered = RenderClip(clip, voiceBuffer.data(), frames);
+			AddSamples(output, voiceBuffer.data(), rendered * channels);
+		}
+
+		currentlyPlayingClips.erase(std::remove_if(currentlyPlayingClips.begin(), currentlyPlayingClips.end(), [](const CurrentlyPlayingClip &clip) { return clip.finished; }), currentlyPlayingClips.end());
+
+		onUserSoundBlock(output, frames, channels, globalTime, timeStep);
+		onUserSoundFilterBlock(output, frames, channels, globalTime, timeStep);
+	}
+
+	//Writes up to the given number of frames of the clip and returns how many were written
+	int RenderClip(CurrentlyPlayingClip &clip, float *output, int frames)
+	{
+		//Streamed clips are converted from the mapped file while they are rendered
+		if (clip.clip->streamedData != nullptr)
+			return RenderClipSamples(clip, clip.clip->streamedData, output, frames);
+
+		return RenderClipSamples(clip, clip.clip->data, output, frames);
+	}
+
+	template<typename Sample>
+	int RenderClipSamples(CurrentlyPlayingClip &clip, const Sample *data, float *output, int frames)
+	{
+		switch (resampler.load())
+		{
+			case RESAMPLE_NEAREST:
+				return RenderClipSamples<RESAMPLE_NEAREST>(clip, data, output, frames);
+			case RESAMPLE_SINC:
+				return RenderClipSamples<RESAMPLE_SINC>(clip, data, output, frames);
+			default:
+				return RenderClipSamples<RESAMPLE_LINEAR>(clip, data, output, frames);
+		}
+	}
+
+	template<Resampler resampling, typename Sample>
+	int RenderClipSamples(CurrentlyPlayingClip &clip, const Sample *data, float *output, int frames)
+	{
+		const AudioClip &audioClip = *clip.clip;
+		int clipChannels = audioClip.format.nChannels;
+		unsigned long long clipEnd = (unsigned long long)audioClip.length << 32;
+
+		//The step is constant over the block, so the position is advanced without any conversions per sample
+		double ratio = (double)audioClip.format.nSamplesPerSec / (double)samplesPerSec * (double)clip.pitch;
+		unsigned long long step = (unsigned long long)(ratio * 4294967296.0);
+
+		int frame = 0;
+		while (frame < frames)
+		{
+			if (clip.position >= clipEnd)
+			{
+				if (!clip.looped || clipEnd == 0)
+				{
+					clip.finished = true;
+					break;
+				}
+
+				//Keep the fractional part so that looping doesn't introduce jitter
+				clip.position %= clipEnd;
+			}
+
+			long index = (long)(clip.position >> 32);
+			unsigned int fraction = (unsigned int)clip.position;
+
+			//Device channels beyond the ones in the clip repeat the clip's channels, e.g. mono clips play on both stereo channels
+			for (int c = 0; c < channels; c++)
+				output[c] = ResampleClip<resampling>(clip, data, index, fraction, c % clipChannels);
+
+			output += channels;
+			clip.position += step;
+			frame++;
+		}
+
+		return frame;
+	}
+
+	template<Resampler resampling, typename Sample>
+	float ResampleClip(const CurrentlyPlayingClip &clip, const Sample *data, long index, unsigned int fraction, int channel)
+	{
+		const AudioClip &audioClip = *clip.clip;
+		int clipChannels = audioClip.format.nChannels;
+
+		if (resampling == RESAMPLE_NEAREST)
+		{
+			//The upper bit of the fraction rounds to the closer frame
+			long nearest = index + (long)(fraction >> 31);
+			if (nearest < audioClip.length)
+				return ToFloat(data[nearest * clipChannels + channel]);
+
+			return GetClipSample(clip, data, nearest, channel);
+		}
+		else if (resampling == RESAMPLE_LINEAR)
+		{
+			float t = (float)fraction * (1.0f / 4294967296.0f);
+
+			float a, b;
+			if (index + 1 < audioClip.length)
+			{
+				a = ToFloat(data[index * clipChannels + channel]);
+				b = ToFloat(data[(index + 1) * clipChannels + channel]);
+			}
+			else
+			{
+				a = GetClipSample(clip, data, index, channel);
+				b = GetClipSample(clip, data, index + 1, channel);
+			}
+
+			return a + (b - a) * t;
+		}
+		else
+		{
+			const float *taps = GetSincTable()[fraction >> (32 - sincPhaseBits)];
+
+			float sample = 0.0f;
+			if (index - sincTaps / 2 + 1 >= 0 && index + sincTaps / 2 < audioClip.length)
+			{
+				const Sample *source = data + (index - sincTaps / 2 + 1) * clipChannels + channel;
+				for (int k = 0; k < sincTaps; k++)
+					sample += taps[k] * ToFloat(source[k * clipChannels]);
+			}
+			else
+			{
+				for (int k = 0; k < sincTaps; k++)
+					sample += taps[k] * GetClipSample(clip, data, index - sincTaps / 2 + 1 + k, channel);
+			}
+
+			return sample;
+		}
+	}
+
+	//Returns a sample at any frame index, wrapping around for looped clips and silent outside of the others
+	template<typename Sample>
+	static float GetClipSample(const CurrentlyPlayingClip &clip, const Sample *data, long index, int channel)
+	{
+		const AudioClip &audioClip = *clip.clip;
+
+		if (index < 0 || index >= audioClip.length)
+		{
+			if (!clip.looped)
+				return 0.0f;
+
+			index %= audioClip.length;
+			if (index < 0)
+				index += audioClip.length;
+		}
+
+		return ToFloat(data[index * audioClip.format.nChannels + channel]);
+	}
+
+	static float ToFloat(float sample)
+	{
+		return sample;
+	}
+
+	static float ToFloat(short sample)
+	{
+		return (float)sample / (float)MAXSHORT;
+	}
+
+	static const int sincTaps = 8;
+	static const int sincPhaseBits = 8;
+
+	typedef float SincTable[1 << sincPhaseBits][sincTaps];
+
+	//Blackman-windowed sinc weights for every phase between two frames, normalized to keep the gain at one
+	static const SincTable& GetSincTable()
+	{
+		static SincTable table;
+		static bool initialized = [&]()
+		{
+			const double pi = 3.14159265358979323846;
+			for (int phase = 0; phase < (1 << sincPhaseBits); phase++)
+			{
+				double t = (double)phase / (double)(1 << sincPhaseBits);
+				double sum = 0.0;
+
+				for (int k = 0; k < sincTaps; k++)
+				{
+					//Distance from the tap to the position being sampled
+					double x = (double)(k - sincTaps / 2 + 1) - t;
+					double sinc = (x == 0.0) ? 1.0 : sin(pi * x) / (pi * x);
+
+					double w = (x + sincTaps / 2) / sincTaps;
+					double window = 0.42 - 0.5 * cos(2.0 * pi * w) + 0.08 * cos(4.0 * pi * w);
+
+					table[phase][k] = (float)(sinc * window);
+					sum += sinc * window;
+				}
+
+				for (int k = 0; k < sincTaps; k++)
+					table[phase][k] = (float)(table[phase][k] / sum);
+			}
+			return true;
+		}();
+
+		(void)initialized;
+		return table;
+	}
+
+	static void AddSamples(float *destination, const float *source, int count)
+	{
+		int i = 0;
+
+#ifdef CGE_SSE2
+		for (; i + 8 <= count; i += 8)
+		{
+			_mm_storeu_ps(destination + i, _mm_add_ps(_mm_loadu_ps(destination + i), _mm_loadu_ps(source + i)));
+			_mm_storeu_ps(destination + i + 4, _mm_add_ps(_mm_loadu_ps(destination + i + 4), _mm_loadu_ps(source + i + 4)));
+		}
+#endif
+
+		for (; i < count; i++)
+			destination[i] += source[i];
+	}
+
+	//Clips the samples to [-1, 1] and converts them to 16-bit integers
+	static void ConvertToPCM16(const float *source, short *destination, int count)
+	{
+		int i = 0;
+
+#ifdef CGE_SSE2
+		const __m128 minSample = _mm_set1_ps(-1.0f);
+		const __m128 maxSample = _mm_set1_ps(1.0f);
+		const __m128 scale = _mm_set1_ps((float)MAXSHORT);
+
+		for (; i + 8 <= count; i += 8)
+		{
+			__m128 low = _mm_mul_ps(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(source + i), minSample), maxSample), scale);
+			__m128 high = _mm_mul_ps(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(source + i + 4), minSample), maxSample), scale);
+			_mm_storeu_si128((__m128i*)(destination + i), _mm_packs_epi32(_mm_cvttps_epi32(low), _mm_cvttps_epi32(high)));
+		}
+#endif
+
+		for (; i < count; i++)
+		{
+			float sample = source[i];
+			if (sample > 1.0f)
+				sample = 1.0f;
+			else if (sample < -1.0f)
+				sample = -1.0f;
+
+			destination[i] = (short)(sample * (float)MAXSHORT);
+		}
+	}
+
+	void ProcessAudioCommands()
+	{
+		AudioCommand command;
+		while (audioCommands.Pop(command))
+		{
+			switch (command.type)
+			{
+				case AUDIO_PLAY:
+					currentlyPlayingClips.push_back(CurrentlyPlayingClip(command.audioClipID, command.clip, command.looped, command.value));
+					break;
+
+				case AUDIO_PAUSE:
+				case AUDIO_PAUSE_ALL:
+					for (auto &clip : currentlyPlayingClips)
+					{
+						if (command.type == AUDIO_PAUSE_ALL || clip.audioClipID == command.audioClipID)
+							clip.paused = !clip.paused;
+					}
+					break;
+
+				case AUDIO_RESTART:
+				case AUDIO_RESTART_ALL:
+					for (auto &clip : currentlyPlayingClips)
+					{
+						if (command.type == AUDIO_RESTART_ALL || clip.audioClipID == command.audioClipID)
+							clip.Restart();
+					}
+					break;
+
+				case AUDIO_STOP:
+					for (auto &clip : currentlyPlayingClips)
+					{
+						if (clip.audioClipID == command.audioClipID)
+							clip.finished = true;
+					}
+					break;
+
+				case AUDIO_STOP_ALL:
+					currentlyPlayingClips.clear();
+					break;
+
+				case AUDIO_SET_PITCH:
+					for (auto &clip : currentlyPlayingClips)
+					{
+						if (clip.audioClipID == command.audioClipID)
+							clip.pitch = command.value;
+					}
+					break;
+
+				case AUDIO_RELEASE:
+					currentlyPlayingClips.erase(std::remove_if(currentlyPlayingClips.begin(), currentlyPlayingClips.end(),
+						[&](const CurrentlyPlayingClip &clip) { return clip.clip == command.clip; }), currentlyPlayingClips.end());
+					command.clip->released.store(true, std::memory_order_release);
+					break;
+			}
+		}
+	}
+
+	void SendAudioCommand(AudioCommandType type, int id = 0, AudioClip *clip = nullptr, bool looped = false, float value = 0.0f)
+	{
+		AudioCommand command;
+		command.type = type;
+		command.audioClipID = id;
+		command.clip = clip;
+		command.looped = looped;
+		command.value = value;
+
+		//If the mixer hasn't caught up with the queue, the command is kept rather than waiting for it or dropping it,
+		//and sent again with later commands and once per frame, in the original order
+		SendDeferredAudioCommands();
+
+		if (!deferredAudioCommands.empty() || !audioCommands.Push(command))
+			deferredAudioCommands.push_back(command);
+
+		//Without the audio thread nobody else consumes the queue
+		if (!audioThreadActive)
+			SendDeferredAudioCommands();
+	}
+
+	void SendDeferredAudioCommands()
+	{
+		size_t sent = 0;
+		while (sent < deferredAudioCommands.size())
+		{
+			if (!audioCommands.Push(deferredAudioCommands[sent]))
+			{
+				//The queue is only drained here if there is no audio thread to do it
+				if (audioThreadActive)
+					break;
+
+				ProcessAudioCommands();
+				continue;
+			}
+			sent++;
+		}
+
+		deferredAudioCommands.erase(deferredAudioCommands.begin(), deferredAudioCommands.begin() + sent);
+
+		if (!audioThreadActive)
+			ProcessAudioCommands();
+	}
+
+public:
+	//A pitch of 2 plays the clip twice as fast and an octave higher
+	void PlayAudioClip(int id, bool loop = false, float pitch = 1.0f)
+	{
+		if (id < 0 || id >= (int)audioClips.size() || audioClips[id] == nullptr || pitch <= 0.0f) return;
+		SendAudioCommand(AUDIO_PLAY, id, audioClips[id].get(), loop, pitch);
+	}
+
+protected:
+	//Streams the clip from a memory-mapped file instead of decoding it up front, which suits long music tracks.
+	//Only 16-bit PCM files are supported.
+	unsigned int LoadStreamingAudioClip(std::wstring fileName)
+	{
+		std::unique_ptr<AudioClip> audioClip = std::make_unique<AudioClip>();
+
+		if (!audioClip->OpenStream(fileName))
+			return -1;
+
+		audioClips.push_back(std::move(audioClip));
+		return audioClips.size() - 1;
+	}
+
+	//Loading a file that is already loaded returns the same ID and only adds a reference to the clip
+	unsigned int LoadAudioClip(std::wstring fileName)
+	{
+		auto cached = audioClipCache.find(fileName);
+		if (cached != audioClipCache.end())
+		{
+			audioClips[cached->second]->references++;
+			return cached->second;
+		}
+
+		return AddAudioClip(std::make_unique<AudioClip>(fileName), fileName);
+	}
+
+	//Decodes the clip on a separate thread; poll the handle with PollAudioClip to get its ID
+	AudioClipHandle LoadAudioClipAsync(std::wstring fileName)
+	{
+		AudioClipHandle handle = std::make_shared<AudioClipLoad>();
+		handle->fileName = fileName;
+
+		auto cached = audioClipCache.find(fileName);
+		if (cached != audioClipCache.end())
+		{
+			audioClips[cached->second]->references++;
+			handle->id = cached->second;
+			handle->registered = true;
+			handle->ready = true;
+			return handle;
+		}
+
+		//The loader only touches the handle, which it keeps alive by itself
+		AudioClipLoader loader;
+		loader.handle = handle;
+		loader.thread = std::thread([handle]()
+		{
+			handle->clip = std::make_unique<AudioClip>(handle->fileName);
+			handle->ready.store(true, std::memory_order_release);
+		});
+		audioClipLoaders.push_back(std::move(loader));
+
+		return handle;
+	}
+
+	//Returns true once the load has finished, after which the ID is the clip's ID, or -1 if the clip couldn't be loaded
+	bool PollAudioClip(const AudioClipHandle &handle, int &id)
+	{
+		if (handle == nullptr || !handle->ready.load(std::memory_order_acquire))
+			return false;
+
+		if (!handle->registered)
+		{
+			JoinAudioClipLoaders(handle.get());
+			handle->id = AddAudioClip(std::move(handle->clip), handle->fileName);
+			handle->registered = true;
+		}
+
+		id = handle->id;
+		return true;
+	}
+
+	//Drops a reference to the clip; once none are left all of its instances are stopped and it is freed.
+	//The ID of a freed clip is not reused.
+	void UnloadAudioClip(int id)
+	{
+		if (id < 0 || id >= (int)audioClips.size() || audioClips[id] == nullptr) return;
+
+		AudioClip *clip = audioClips[id].get();
+		if (--clip->references > 0) return;
+
+		if (!clip->fileName.empty())
+			audioClipCache.erase(clip->fileName);
+
+		retiredAudioClips.push_back(std::move(audioClips[id]));
+		SendAudioCommand(AUDIO_RELEASE, id, clip);
+
+		FreeReleasedAudioClips();
+	}
+
+private:
+	int AddAudioClip(std::unique_ptr<AudioClip> audioClip, const std::wstring &fileName)
+	{
+		if (audioClip == nullptr || !audioClip->isValid)
+			return -1;
+
+		//Another load of the same file may have finished in the meantime
+		auto cached = audioClipCache.find(fileName);
+		if (cached != audioClipCache.end())
+		{
+			audioClips[cached->second]->references++;
+			return cached->second;
+		}
+
+		audioClip->fileName = fileName;
+		audioClips.push_back(std::move(audioClip));
+		audioClipCache[fileName] = audioClips.size() - 1;
+
+		FreeReleasedAudioClips();
+		return audioClips.size() - 1;
+	}
+
+	void FreeReleasedAudioClips()
+	{
+		SendDeferredAudioCommands();
+		retiredAudioClips.erase(std::remove_if(retiredAudioClips.begin(), retiredAudioClips.end(),
+			[](const std::unique_ptr<AudioClip> &clip) { return clip->released.load(std::memory_order_acquire); }), retiredAudioClips.end());
+	}
+
+protected:
+
+	//The default waveOut backend queues blockCount blocks of samplesPerBlock samples, about 90ms at the default settings.
+	//WASAPI streams cope with much smaller blocks, e.g. 2 blocks of 256 samples, and return false if no device supports the format.
+	bool StartAudio(int samplesPerSec = 44100, int channels = 1, int blockCount = 8, int samplesPerBlock = 512, AudioBackendType backend = AUDIO_BACKEND_WAVEOUT)
+	{
+		if (backend == AUDIO_BACKEND_WAVEOUT)
+			return StartAudio(std::make_unique<WaveOutBackend>(), samplesPerSec, channels, blockCount, samplesPerBlock);
+
+		return StartAudio(std::make_unique<WasapiBackend>(backend == AUDIO_BACKEND_WASAPI_EXCLUSIVE), samplesPerSec, channels, blockCount, samplesPerBlock);
+	}
+
+	//Plays the mixed audio through a custom backend
+	bool StartAudio(std::unique_ptr<AudioBackend> backend, int samplesPerSec = 44100, int channels = 1, int blockCount = 8, int samplesPerBlock = 512)
+	{
+		if (audioBackend != nullptr)
+			DestroyAudio();
+
+		if (backend == nullptr || channels < 1 || blockCount < 1 || samplesPerBlock < channels)
+			return false;
+
+		int frames = samplesPerBlock / channels;
+		if (!backend->Open(samplesPerSec, channels, blockCount, frames))
+			return false;
+
+		audioBackend = std::move(backend);
+
+		this->samplesPerSec = samplesPerSec;
+		this->channels = channels;
+		framesPerBlock = frames;
+
+		soundMuted = false;
+		currentVolume = MAX_VOLUME;
+
+		audioLatency = 0.0f;
+		audioMixTime = 0.0f;
+		audioUnderruns = 0;
+
+		mixBuffer.assign((size_t)frames * channels, 0.0f);
+		voiceBuffer.assign((size_t)frames * channels, 0.0f);
+
+		//Leave room for plenty of simultaneous clips so that the mixer doesn't need to allocate
+		currentlyPlayingClips.reserve(64);
+
+		audioThreadActive = true;
+		audioThread = std::thread(&ConsoleGameEngine::AudioThread, this);
+
+		return true;
+	}
+
+	void DestroyAudio()
+	{
+		audioThreadActive = false;
+
+		if (audioBackend != nullptr)
+			audioBackend->Wake();
+
+		if (audioThread.joinable())
+			audioThread.join();
+
+		//Apply whatever the mixer didn't get to, so that unloaded clips are released
+		ProcessAudioCommands();
+		FreeReleasedAudioClips();
+
+		//Loads that are still running finish now; their handles can be polled afterwards as usual
+		JoinAudioClipLoaders();
+
+		if (audioBackend != nullptr)
+			audioBackend->Close();
+		audioBackend.reset();
+		soundMuted = false;
+
+		samplesPerSec = 0;
+		channels = 0;
+		framesPerBlock = 0;
+
+		globalTime = 0.0f;
+	}
+
+	AudioStats GetAudioStats()
+	{
+		AudioStats stats;
+		stats.latency = audioLatency;
+		stats.mixTime = audioMixTime;
+		stats.underruns = audioUnderruns;
+		stats.framesPerBlock = framesPerBlock;
+		return stats;
+	}
+
+	virtual float onUserSoundSample(int channel, float globalTime, float timeStep)
+	{
+		return 0.0f;
+	}
+
+	virtual float onUserSoundFilter(int channel, float globalTime, float mixedSample)
+	{
+		return mixedSample;
+	}
+
+	//Adds user generated sound to a block of interleaved samples, frames * channels in total.
+	//The default implementation calls onUserSoundSample() for every sample; override it to generate whole blocks at once.
+	virtual void onUserSoundBlock(float *samples, int frames, int channels, float globalTime, float timeStep)
+	{
+		for (int f = 0; f < frames; f++)
+		{
+			float time = globalTime + (float)f * timeStep;
+			for (int c = 0; c < channels; c++)
+				samples[f * channels + c] += onUserSoundSample(c, time, timeStep);
+		}
+	}
+
+	//Filters a block of interleaved samples, frames * channels in total.
+	//The default implementation calls onUserSoundFilter() for every sample; override it to filter whole blocks at once.
+	virtual void onUserSoundFilterBlock(float *samples, int frames, int channels, float globalTime, float timeStep)
+	{
+		for (int f = 0; f < frames; f++)
+		{
+			float time = globalTime + (float)f * timeStep;
+			for (int c = 0; c < channels; c++)
+				samples[f * channels + c] = onUserSoundFilter(c, time, samples[f * channels + c]);
+		}
+	}
+
+	int GetVolume()
+	{
+		return currentVolume;
+	}
+
+	void SetVolume(float percent)
+	{
+		if (percent < 0)
+			percent = 0;
+		else if (percent > 100)
+			percent = 100;
+
+		int oneChannelVolume = (int)(percent * 2.55f);
+		currentVolume = oneChannelVolume * oneChannelVolume;
+		if (!soundMuted && audioBackend != nullptr)
+			audioBackend->SetVolume(MAKELONG(currentVolume, currentVolume));
+	}
+
+	void MuteAudio()
+	{
+		soundMuted = true;
+		if (audioBackend != nullptr)
+			audioBackend->SetVolume(0x0000);
+	}
+
+	void UnmuteAudio()
+	{
+		soundMuted = false;
+		if (audioBackend != nullptr)
+			audioBackend->SetVolume(MAKELONG(currentVolume, currentVolume));
+	}
+
+	void PauseAudio(int id)
+	{
+		SendAudioCommand(AUDIO_PAUSE, id);
+	}
+
+	void PauseAllAudio()
+	{
+		SendAudioCommand(AUDIO_PAUSE_ALL);
+	}
+
+	void RestartAudio(int id)
+	{
+		SendAudioCommand(AUDIO_RESTART, id);
+	}
+
+	void RestartAllAudio()
+	{
+		SendAudioCommand(AUDIO_RESTART_ALL);
+	}
+
+	void StopAudio(int id)
+	{
+		SendAudioCommand(AUDIO_STOP, id);
+	}
+
+	void SetAudioPitch(int id, float pitch)
+	{
+		if (pitch <= 0.0f) return;
+		SendAudioCommand(AUDIO_SET_PITCH, id, nullptr, false, pitch);
+	}
+
+	void SetResampler(Resampler resampler)
+	{
+		this->resampler = resampler;
+	}
+
+	void StopAllAudio()
+	{
+		SendAudioCommand(AUDIO_STOP_ALL);
+		if (audioBackend != nullptr)
+			audioBackend->Flush();
+	}
 
-			fread(contents, sizeof(CHAR_INFO), width * height, file);
+	///////////////////////////////////////// JOBS /////////////////////////////////////////////////
 
-			fclose(file);
+private:
+	//Persistent pool of workers that split jobs into chunks together with the calling thread
+	std::vector<std::thread> workers;
+	bool workersConfigured = false;
+	bool workersStopping = false;
+
+	std::mutex jobMutex;
+	std::condition_variable jobAvailable;
+	std::condition_variable jobFinished;
+
+	const std::function<void(int)> *job = nullptr;
+	int jobChunkCount = 0;
+	std::atomic<int> nextJobChunk = 0;
+	int jobWorkersPending = 0;
+	unsigned int jobGeneration = 0;
+
+	//Tiles of the screen are multiples of 16 cells, i.e. 64 bytes. Since the screen starts on a cache line, two threads never share one.
+	static const int tileCells = 16 * 64;
+
+	//Bands have at least as many cells as a tile, and also start on a multiple of 16 cells
+	int GetRowsPerBand()
+	{
+		int rows = (tileCells + screenWidth - 1) / screenWidth;
 
-			return true;
-		}
+		int alignment = 16;
+		for (int width = screenWidth; alignment > 1 && width % 2 == 0; width /= 2)
+			alignment /= 2;
 
-	};
+		return (rows + alignment - 1) / alignment * alignment;
+	}
 
-protected:
-	void Draw(int index, short character = DEFAULT_CHAR, short color = DEFAULT_COLOR)
+	void StartWorkers(int count)
 	{
-		if (index >= 0 || index < screenWidth * screenHeight)
-		{
-			screen[index].Char.UnicodeChar = character;
-			screen[index].Attributes = color;
-		}
+		workersConfigured = true;
+		workersStopping = false;
+
+		for (int i = 0; i < count; i++)
+			workers.push_back(std::thread(&ConsoleGameEngine::WorkerThread, this, jobGeneration));
 	}
 
-	void DrawPoint(int x, int y, short character = DEFAULT_CHAR, short color = DEFAULT_COLOR)
+	void StopWorkers()
 	{
-		if (x >= 0 && x < screenWidth && y >= 0 && y < screenHeight)
 		{
-			int index = screenWidth * y + x;
-			screen[index].Char.UnicodeChar = character;
-			screen[index].Attributes = color;
+			std::unique_lock<std::mutex> lock(jobMutex);
+			workersStopping = true;
 		}
+		jobAvailable.notify_all();
+
+		for (auto &worker : workers)
+			worker.join();
+
+		workers.clear();
 	}
 
-	void DrawLine(int x0, int y0, int x1, int y1, short character = DEFAULT_CHAR, short color = DEFAULT_COLOR)
+	//Workers start out at the current generation, so they only pick up jobs submitted after they were started
+	void WorkerThread(unsigned int generation)
 	{
-		int dx = abs(x1 - x0);
-		int sx = (x0 < x1) ? 1 : -1;
-		int dy = -abs(y1 - y0);
-		int sy = (y0 < y1) ? 1 : -1;
-		int error = dx + dy;
 		while (true)
 		{
-			DrawPoint(x0, y0, character, color);
-			if (x0 == x1 && y0 == y1)
-				break;
-			int e2 = error * 2;
-			if (e2 >= dy)
 			{
-				error += dy;
-				x0 += sx;
+				std::unique_lock<std::mutex> lock(jobMutex);
+				jobAvailable.wait(lock, [&] { return workersStopping || jobGeneration != generation; });
+
+				if (workersStopping)
+					return;
+
+				generation = jobGeneration;
 			}
-			if (e2 <= dx)
+
+			RunJobChunks();
+
 			{
-				error += dx;
-				y0 += sy;
+				std::unique_lock<std::mutex> lock(jobMutex);
+				if (--jobWorkersPending == 0)
+					jobFinished.notify_one();
 			}
 		}
 	}
 
-	void DrawTriangle(int x0, int y0, int x1, int y1, int x2, int y2, short character = DEFAULT_CHAR, short color = DEFAULT_COLOR)
+	void RunJobChunks()
 	{
-		DrawLine(x0, y0, x1, y1, character, color);
-		DrawLine(x1, y1, x2, y2, character, color);
-		DrawLine(x2, y2, x0, y0, character, color);
+		int chunk;
+		while ((chunk = nextJobChunk.fetch_add(1)) < jobChunkCount)
+			(*job)(chunk);
 	}
 
-	void DrawFilledTriangle(int x0, int y0, int x1, int y1, int x2, int y2, short character = DEFAULT_CHAR, short color = DEFAULT_COLOR)
+	//Calls the function for every chunk and returns once all of them are done
+	void RunJob(int chunks, const std::function<void(int)> &function)
 	{
-		if (y1 < y0)
-		{
-			std::swap(y1, y0);
-			std::swap(x1, x0);
-		}
-		if (y2 < y0)
-		{
-			std::swap(y2, y0);
-			std::swap(x2, x0);
-		}
-		if (y2 < y1)
+		if (!workersConfigured)
 		{
-			std::swap(y2, y1);
-			std::swap(x2, x1);
+			int hardwareThreads = (int)std::thread::hardware_concurrency();
+			StartWorkers(hardwareThreads > 1 ? hardwareThreads - 1 : 0);
 		}
 
-		if (y1 == y2)
-		{
-			FillBottomFlatTriangle(x0, y0, x1, y1, x2, y2, character, color);
-		}
-		else if (y0 == y1)
-		{
-			FillTopFlatTriangle(x0, y0, x1, y1, x2, y2, character, color);
-		}
-		else
+		if (workers.empty() || chunks <= 1)
 		{
-			int x3 = (int)(x0 + ((float)(y1 - y0) / (float)(y2 - y0)) * (x2 - x0) + 0.5f);
-			int y3 = y1;
-			FillBottomFlatTriangle(x0, y0, x1, y1, x3, y3, character, color);
-			FillTopFlatTriangle(x1, y1, x3, y3, x2, y2, character, color);
+			for (int chunk = 0; chunk < chunks; chunk++)
+				function(chunk);
+			return;
 		}
-		DrawLine(x0, y0, x1, y1, character, color);
-		DrawLine(x1, y1, x2, y2, character, color);
-		DrawLine(x2, y2, x0, y0, character, color);
-	}
-
-private:
-	void FillBottomFlatTriangle(int x0, int y0, int x1, int y1, int x2, int y2, short character = DEFAULT_CHAR, short color = DEFAULT_COLOR)
-	{
-		float invSlopeLeft = (float)(x1 - x0) / (float)(y1 - y0);
-		float invSlopeRight = (float)(x2 - x0) / (float)(y2 - y0);
 
-		float leftX = (float)x0;
-		float rightX = (float)x0;
-
-		for (int y = y0; y <= y1; y++)
 		{
-			DrawLine((int)(leftX + 0.5f), y, (int)(rightX + 0.5f), y, character, color);
-			leftX += invSlopeLeft;
-			rightX += invSlopeRight;
+			std::unique_lock<std::mutex> lock(jobMutex);
+			job = &function;
+			jobChunkCount = chunks;
+			nextJobChunk = 0;
+			jobWorkersPending = (int)workers.size();
+			jobGeneration++;
 		}
-	}
-
-	void FillTopFlatTriangle(int x0, int y0, int x1, int y1, int x2, int y2, short character = DEFAULT_CHAR, short color = DEFAULT_COLOR)
-	{
-		float invSlopeLeft = (float)(x2 - x0) / (float)(y2 - y0);
-		float invSlopeRight = (float)(x2 - x1) / (float)(y2 - y1);
+		jobAvailable.notify_all();
 
-		float leftX = (float)x2;
-		float rightX = (float)x2;
+		RunJobChunks();
 
-		for (int y = y2; y > y0; y--)
-		{
-			DrawLine((int)(leftX + 0.5f), y, (int)(rightX + 0.5f), y, character, color);
-			leftX -= invSlopeLeft;
-			rightX -= invSlopeRight;
-		}
+		//Every worker has to check in, even if it found no chunks left, before the function may go out of scope
+		std::unique_lock<std::mutex> lock(jobMutex);
+		jobFinished.wait(lock, [&] { return jobWorkersPending == 0; });
+		job = nullptr;
 	}
 
 protected:
-	void DrawRectangle(int x0, int y0, int x1, int y1, short character = DEFAULT_CHAR, short color = DEFAULT_COLOR)
+	//Number of threads that help the game thread with parallel jobs. By default one less than the number of hardware threads.
+	void SetWorkerCount(int count)
 	{
-		DrawLine(x0, y0, x1, y0, character, color);
-		DrawLine(x0, y1, x1, y1, character, color);
-		DrawLine(x0, y0, x0, y1, character, color);
-		DrawLine(x1, y0, x1, y1, character, color);
+		StopWorkers();
+		StartWorkers(count > 0 ? count : 0);
 	}
 
-	void DrawFilledRectangle(int x0, int y0, int x1, int y1, short character = DEFAULT_CHAR, short color = DEFAULT_COLOR)
+	int GetWorkerCount()
 	{
-		if (y1 < y0)
-		{
-			std::swap(y1, y0);
-			std::swap(x1, x0);
-		}
-		for (int y = y0; y <= y1; y++)
-		{
-			DrawLine(x0, y, x1, y, character, color);
-		}
+		return (int)workers.size();
 	}
 
-	void DrawCircle(int cx, int cy, int r, short character = DEFAULT_CHAR, short color = DEFAULT_COLOR)
+	//Calls shader(y) for every row of the screen, spread across the workers. Rows are handed out in bands.
+	template<typename Shader>
+	void ParallelForRows(Shader shader)
 	{
-		int x = r;
-		int y = 0;
-		int sx = 1 - (2 * r);
-		int sy = 1;
-		int error = 0;
-		while (x >= y)
-		{
-			DrawPoint(cx + x, cy + y, character, color); //Octant 1
-			DrawPoint(cx - x, cy + y, character, color); //Octant 4
-			DrawPoint(cx - x, cy - y, character, color); //Octant 5
-			DrawPoint(cx + x, cy - y, character, color); //Octant 8
-			DrawPoint(cx + y, cy + x, character, color); //Octant 2
-			DrawPoint(cx - y, cy + x, character, color); //Octant 3
-			DrawPoint(cx - y, cy - x, character, color); //Octant 6
-			DrawPoint(cx + y, cy - x, character, color); //Octant 7
+		int rowsPerBand = GetRowsPerBand();
+		int bands = (screenHeight + rowsPerBand - 1) / rowsPerBand;
 
-			y++;
-			error += sy;
-			sy += 2;
-			if (2 * error + sx > 0)
-			{
-				x--;
-				error += sx;
-				sx += 2;
-			}
-		}
+		RunJob(bands, [&](int band)
+		{
+			int y1 = min((band + 1) * rowsPerBand, screenHeight);
+			for (int y = band * rowsPerBand; y < y1; y++)
+				shader(y);
+		});
 	}
 
-	void DrawFilledCircle(int cx, int cy, int r, short character = DEFAULT_CHAR, short color = DEFAULT_COLOR)
+	//Calls shader(x, y, cell) for every cell of the screen, spread across the workers in tiles of consecutive cells
+	template<typename Shader>
+	void ParallelForCells(Shader shader)
 	{
-		int x = r;
-		int y = 0;
-		int sx = 1 - (2 * r);
-		int sy = 1;
-		int error = 0;
-		while (x >= y)
+		int cells = screenWidth * screenHeight;
+		int tiles = (cells + tileCells - 1) / tileCells;
+
+		RunJob(tiles, [&](int tile)
 		{
-			DrawLine(cx + x, cy + y, cx - x, cy + y, character, color);	//Octants 1 and 4
-			DrawLine(cx - x, cy - y, cx + x, cy - y, character, color);	//Octants 5 and 8
-			DrawLine(cx + y, cy + x, cx - y, cy + x, character, color);	//Octants 2 and 3
-			DrawLine(cx - y, cy - x, cx + y, cy - x, character, color); //Octants 6 and 7
+			int begin = tile * tileCells;
+			int end = min(begin + tileCells, cells);
+			int x = begin % screenWidth;
+			int y = begin / screenWidth;
 
-			y++;
-			error += sy;
-			sy += 2;
-			if (2 * error + sx > 0)
+			for (int i = begin; i < end; i++)
 			{
-				x--;
-				error += sx;
-				sx += 2;
+				shader(x, y, screen[i]);
+
+				if (++x == screenWidth)
+				{
+					x = 0;
+					y++;
+				}
 			}
-		}
+		});
 	}
 
-	void DrawSprite(int x, int y, Sprite& sprite)
+	/////////////////////////////////////// PROFILER ///////////////////////////////////////////////
+
+public:
+	enum ProfilerPhase
 	{
-		for (int i = 0; i < sprite.GetWidth(); i++)
-		{
-			for (int j = 0; j < sprite.GetHeight(); j++)
-			{
-				DrawPoint(x + i, y + j, sprite.GetCharacter(i, j), sprite.GetColor(i, j));
-			}
-		}
-	}
+		PHASE_INPUT,
+		PHASE_FIXED_UPDATE,
+		PHASE_UPDATE,
+		PHASE_POST_PROCESS,
+		PHASE_PRESENT,
+		PHASE_AUDIO,	//Time spent mixing one block of audio samples
+		PHASE_INPUT_LATENCY,	//Time between the input thread receiving an event and the frame handling it
+		PHASE_FRAME,	//Time between the starts of two consecutive frames
+		PHASE_COUNT
+	};
 
-	void DrawSpriteAlpha(int x, int y, Sprite& sprite, short transparencyCol)
+	enum ProfileFormat
 	{
-		for (int i = 0; i < sprite.GetWidth(); i++)
-		{
-			for (int j = 0; j < sprite.GetHeight(); j++)
-			{
-				if (sprite.GetColor(i, j) != transparencyCol)
-				{
-					DrawPoint(x + i, y + j, sprite.GetCharacter(i, j), sprite.GetColor(i, j));
-				}
-			}
-		}
-	}
+		PROFILE_CSV,
+		PROFILE_JSON
+	};
 
-	void DrawPartialSprite(int x, int y, Sprite& sprite, int ox, int oy, int w, int h)
+	//All times are in milliseconds
+	struct ProfileStats
 	{
-		for (int i = 0; i < w; i++)
-		{
-			for (int j = 0; j < h; j++)
-			{
-				DrawPoint(x + i, y + j, sprite.GetCharacter(i + ox, j + oy), sprite.GetColor(i + ox, j + oy));
-			}
-		}
-	}
+		float min = 0.0f;
+		float avg = 0.0f;
+		float p99 = 0.0f;
+		float last = 0.0f;
+		int samples = 0;
+	};
 
-	void DrawPartialSpriteAlpha(int x, int y, Sprite& sprite, int ox, int oy, int w, int h, short transparencyCol)
+	//Measures the time between its construction and destruction and adds it to the given marker of the current frame,
+	//e.g. ProfileScope scope(*this, physicsMarker);
+	class ProfileScope
 	{
-		for (int i = 0; i < w; i++)
+	private:
+		ConsoleGameEngine &engine;
+		int marker;
+		std::chrono::steady_clock::time_point start;
+
+	public:
+		ProfileScope(ConsoleGameEngine &engine, int marker) : engine(engine), marker(marker), start(std::chrono::steady_clock::now()) {}
+
+		~ProfileScope()
 		{
-			for (int j = 0; j < h; j++)
-			{
-				if (sprite.GetColor(i + ox, j + oy) != transparencyCol)
-				{
-					DrawPoint(x + i, y + j, sprite.GetCharacter(i + ox, j + oy), sprite.GetColor(i + ox, j + oy));
-				}
-			}
+			engine.AddMarkerTime(marker, std::chrono::steady_clock::now() - start);
 		}
-	}
+	};
 
-	void DisplayText(int x, int y, std::wstring text, short bgColor = DEFAULT_COLOR, short fgColor = FG_BLACK)
+private:
+	//Rolling window of the most recent samples
+	class ProfileHistory
 	{
-		short index = GetScreenWidth() * y + x;
-		for (size_t i = 0; i < text.size(); i++)
+	private:
+		static const int capacity = 240;
+
+		float samples[capacity];
+		int count = 0;
+		int next = 0;
+
+	public:
+		void Add(float sample)
 		{
-			Draw(index + i, text[i], bgColor | fgColor);
+			samples[next] = sample;
+			next = (next + 1) % capacity;
+			if (count < capacity)
+				count++;
 		}
-	}
 
-	void DisplayTextAlpha(int x, int y, std::wstring text, short bgColor = DEFAULT_COLOR, short fgColor = FG_BLACK)
-	{
-		short index = GetScreenWidth() * y + x;
-		for (size_t i = 0; i < text.size(); i++)
+		void Clear()
 		{
-			if (text[i] != L' ')
-				Draw(index + i, text[i], bgColor | fgColor);
+			count = 0;
+			next = 0;
 		}
-	}
 
-	void Fill(int x, int y, int length, short character = DEFAULT_CHAR, short color = DEFAULT_COLOR)
-	{
-		int index = screenWidth * y + x;
-		for (int i = 0; i < length; i++)
+		ProfileStats GetStats() const
 		{
-			Draw(index + i, character, color);
+			ProfileStats stats;
+			if (count == 0)
+				return stats;
+
+			float sorted[capacity];
+			float sum = 0.0f;
+			for (int i = 0; i < count; i++)
+			{
+				sorted[i] = samples[i];
+				sum += samples[i];
+			}
+
+			int p99Index = (int)ceilf(0.99f * (float)count) - 1;
+			std::nth_element(sorted, sorted + p99Index, sorted + count);
+
+			stats.min = *std::min_element(sorted, sorted + count);
+			stats.avg = sum / (float)count;
+			stats.p99 = sorted[p99Index];
+			stats.last = samples[(next + capacity - 1) % capacity];
+			stats.samples = count;
+			return stats;
 		}
-	}
+	};
 
-	void ClearScreen(short character = DEFAULT_CHAR, short color = BG_BLACK)
+	struct ProfileMarker
 	{
-		Fill(0, 0, screenWidth * screenHeight, character, color);
-	}
+		std::wstring name;
+		ProfileHistory history;
+		float frameTime = 0.0f;
+		bool hit = false;
+	};
 
-	void FloodFill(int x, int y, short color = DEFAULT_COLOR)
-	{
-		int screenSize = screenWidth * screenHeight;
-		int index = screenWidth * y + x;
-		short targetColor = screen[index].Attributes;
+	bool profilerEnabled = false;
+	bool profilerOverlayVisible = false;
 
-		if (targetColor == color) return;
+	ProfileHistory phaseHistory[PHASE_COUNT];
+	std::vector<ProfileMarker> profileMarkers;
 
-		screen[index].Attributes = color;
+	//Written by the audio thread, collected once per frame
+	std::atomic<long long> audioMixNanoseconds = 0;
+	std::atomic<int> audioBlocksMixed = 0;
 
-		std::queue<int> nodes;
-		nodes.push(index);
-		while (!nodes.empty())
-		{
-			int n = nodes.front();
-			nodes.pop();
-			if (n + 1 < screenSize && screen[n + 1].Attributes == targetColor)
-			{
-				screen[n + 1].Attributes = color;
-				nodes.push(n + 1);
-			}
-			if (n - 1 >= 0 && screen[n - 1].Attributes == targetColor)
-			{
-				screen[n - 1].Attributes = color;
-				nodes.push(n - 1);
-			}
-			if (n + screenWidth < screenSize && screen[n + screenWidth].Attributes == targetColor)
-			{
-				screen[n + screenWidth].Attributes = color;
-				nodes.push(n + screenWidth);
-			}
-			if (n - screenWidth >= 0 && screen[n - screenWidth].Attributes == targetColor)
-			{
-				screen[n - screenWidth].Attributes = color;
-				nodes.push(n - screenWidth);
-			}
-		}
+	static float ToMilliseconds(std::chrono::steady_clock::duration duration)
+	{
+		return std::chrono::duration<float, std::milli>(duration).count();
 	}
 
-	void Clip(int &x, int &y)
+	//Records the time since the previous mark and returns the new mark
+	std::chrono::steady_clock::time_point MarkPhase(ProfilerPhase phase, std::chrono::steady_clock::time_point previousMark)
 	{
-		if (x < 0)
-			x = 0;
-		else if (x > screenWidth)
-			x = screenWidth;
+		if (!profilerEnabled)
+			return previousMark;
 
-		if (y < 0)
-			y = 0;
-		else if (y > screenHeight)
-			y = screenHeight;
+		auto mark = std::chrono::steady_clock::now();
+		phaseHistory[phase].Add(ToMilliseconds(mark - previousMark));
+		return mark;
 	}
 
-	//////////////////////////////////////// INPUT /////////////////////////////////////////////////
-
-private:
-	struct KeyState {
-		bool pressed = false;
-		bool held = false;
-		bool released = false;
-	} keys[256];
-
-	short mouseX = 0;
-	short mouseY = 0;
-
-	void ReadInput()
+	void EndProfiledFrame(float elapsedTime)
 	{
-		for (int i = 0; i < 256; i++)
-		{
-			keys[i].pressed = false;
-			keys[i].released = false;
+		if (!profilerEnabled)
+			return;
 
-			if (GetAsyncKeyState(i) & 0x8000)
-			{
-				keys[i].pressed = !keys[i].held;
-				keys[i].held = true;
-			}
-			else if (keys[i].held)
-			{
-				keys[i].released = true;
-				keys[i].held = false;
-			}
-		}
+		phaseHistory[PHASE_FRAME].Add(elapsedTime * 1000.0f);
 
-		INPUT_RECORD inputBuffer[32];
-		DWORD events = 0;
-		GetNumberOfConsoleInputEvents(consoleInput, &events);
-		if (events > 0)
-			ReadConsoleInput(consoleInput, inputBuffer, events, &events);
+		int blocks = audioBlocksMixed.exchange(0);
+		long long nanoseconds = audioMixNanoseconds.exchange(0);
+		if (blocks > 0)
+			phaseHistory[PHASE_AUDIO].Add((float)nanoseconds / (float)blocks / 1000000.0f);
 
-		for (DWORD i = 0; i < events; i++)
+		for (auto &marker : profileMarkers)
 		{
-			switch (inputBuffer[i].EventType)
-			{
-				case MOUSE_EVENT:
-				{
-					switch (inputBuffer[i].Event.MouseEvent.dwEventFlags)
-					{
-						case MOUSE_MOVED:
-						{
-							mouseX = inputBuffer[i].Event.MouseEvent.dwMousePosition.X;
-							mouseY = inputBuffer[i].Event.MouseEvent.dwMousePosition.Y;
-							break;
-						}
-					}
-					break;
-				}
-			}
-		}
+			if (marker.hit)
+				marker.history.Add(marker.frameTime);
 
+			marker.frameTime = 0.0f;
+			marker.hit = false;
+		}
 	}
 
-protected:
-	short GetMouseX()
+	void AddMarkerTime(int marker, std::chrono::steady_clock::duration duration)
 	{
-		return mouseX;
-	}
+		if (!profilerEnabled || marker < 0 || marker >= (int)profileMarkers.size())
+			return;
 
-	short GetMouseY()
-	{
-		return mouseY;
+		profileMarkers[marker].frameTime += ToMilliseconds(duration);
+		profileMarkers[marker].hit = true;
 	}
 
-	KeyState GetKey(short key)
+	static const wchar_t* GetPhaseName(int phase)
 	{
-		return keys[key];
+		static const wchar_t* names[PHASE_COUNT] = { L"input", L"fixed update", L"update", L"post-process", L"present", L"audio block", L"input latency", L"frame" };
+		return names[phase];
 	}
 
-	//////////////////////////////////////// AUDIO /////////////////////////////////////////////////
-
-private:
-	class AudioClip
+	void DrawProfilerOverlay()
 	{
-	public:
-		WAVEFORMATEX format;
-		float *data = nullptr;
+		//Drawn over the composite of the layers, which has to be copied again on the next frame
+		CHAR_INFO *target = screen;
+		screen = mainScreen;
+		layerScreenStale = true;
 
-		long length;
+		wchar_t line[96];
+		int y = 0;
 
-		bool isValid = false;
+		swprintf_s(line, L"%-14ls %8ls %8ls %8ls", L"ms", L"min", L"avg", L"p99");
+		DisplayText(0, y++, line, BG_BLACK, FG_WHITE);
 
-		AudioClip() {}
+		for (int i = 0; i < PHASE_COUNT && y < screenHeight; i++)
+		{
+			ProfileStats stats = phaseHistory[i].GetStats();
+			if (stats.samples == 0)
+				continue;
 
-		~AudioClip() {}
+			swprintf_s(line, L"%-14.14ls %8.3f %8.3f %8.3f", GetPhaseName(i), stats.min, stats.avg, stats.p99);
+			DisplayText(0, y++, line, BG_BLACK, FG_WHITE);
+		}
 
-		AudioClip(std::wstring fileName)
+		for (size_t i = 0; i < profileMarkers.size() && y < screenHeight; i++)
 		{
-			FILE *file = nullptr;
-			if (_wfopen_s(&file, fileName.c_str(), L"rb") != 0) return;
+			ProfileStats stats = profileMarkers[i].history.GetStats();
+			if (stats.samples == 0)
+				continue;
+
+			swprintf_s(line, L"%-14.14ls %8.3f %8.3f %8.3f", profileMarkers[i].name.c_str(), stats.min, stats.avg, stats.p99);
+			DisplayText(0, y++, line, BG_BLACK, FG_YELLOW);
+		}
+
+		screen = target;
+	}
+
+protected:
+	void EnableProfiler(bool enable = true)
+	{
+		profilerEnabled = enable;
 
-			//The majority of header fields take 4 bytes of data
-			char field[4];
+		for (auto &history : phaseHistory)
+			history.Clear();
 
-			//Read the "RIFF" header
-			std::fread(&field, sizeof(char), 4, file);
-			if (strncmp(field, "RIFF", 4) != 0)
-			{
-				std::fclose(file);
-				return;
-			}
+		for (auto &marker : profileMarkers)
+			marker.history.Clear();
 
-			//Read size of the chunk; ignore it
-			std::fread(&field, sizeof(char), 4, file);
+		audioMixNanoseconds = 0;
+		audioBlocksMixed = 0;
+	}
 
-			//Read the "WAVE" header
-			std::fread(&field, sizeof(char), 4, file);
-			if (strncmp(field, "WAVE", 4) != 0)
-			{
-				std::fclose(file);
-				return;
-			}
+	bool IsProfilerEnabled()
+	{
+		return profilerEnabled;
+	}
 
-			//Read the "fmt " header (space included)
-			std::fread(&field, sizeof(char), 4, file);
-			if (strncmp(field, "fmt ", 4) != 0)
-			{
-				std::fclose(file);
-				return;
-			}
+	//Draws the statistics of every phase and marker in the top left corner of the screen after OnUpdate()
+	void ShowProfilerOverlay(bool show = true)
+	{
+		profilerOverlayVisible = show;
+	}
 
-			//Read size of the subchunk; ignore it
-			std::fread(&field, sizeof(char), 4, file);
+	//Returns an ID to be used with ProfileScope. Registering the same name twice returns the same ID.
+	int RegisterProfileMarker(const std::wstring &name)
+	{
+		for (size_t i = 0; i < profileMarkers.size(); i++)
+		{
+			if (profileMarkers[i].name == name)
+				return (int)i;
+		}
 
-			//Read audio file format. WAVEFORMATEX struct takes 2 additional bytes of data that can't be found in .wav files, so we ignore them
-			std::fread(&format, sizeof(WAVEFORMATEX) - 2, 1, file);
+		ProfileMarker marker;
+		marker.name = name;
+		profileMarkers.push_back(marker);
+		return (int)profileMarkers.size() - 1;
+	}
 
-			//Only specific audio format is currently supported
-			if (format.wBitsPerSample != 16 || format.nSamplesPerSec != 44100)
-			{
-				std::fclose(file);
-				return;
-			}
+	ProfileStats GetProfileStats(ProfilerPhase phase)
+	{
+		if (phase < 0 || phase >= PHASE_COUNT)
+			return ProfileStats();
 
-			//Read next subchunk's header and size (this time the size is actually needed)
-			long subchunkSize = 0;
-			std::fread(&field, sizeof(char), 4, file);
-			std::fread(&subchunkSize, sizeof(long), 1, file);
+		return phaseHistory[phase].GetStats();
+	}
 
-			//Search for "data" subchunk. In some cases .wav files may have additional subchunks, so we need to make sure we found the correct one
-			while (strncmp(field, "data", 4) != 0)
-			{
-				std::fseek(file, subchunkSize, SEEK_CUR);
-				std::fread(&field, sizeof(char), 4, file);
-				std::fread(&subchunkSize, sizeof(long), 1, file);
-			}
+	ProfileStats GetMarkerStats(int marker)
+	{
+		if (marker < 0 || marker >= (int)profileMarkers.size())
+			return ProfileStats();
 
-			length = subchunkSize / (format.nChannels * (format.wBitsPerSample / 8));
+		return profileMarkers[marker].history.GetStats();
+	}
 
-			data = new float[length * format.nChannels];
-			float *currentSample = data;
+private:
+	//Marker names can hold anything, so they are written as plain ASCII: JSON escapes everything else,
+	//CSV quotes names with separators in them and replaces characters outside of ASCII with '?'
+	static std::string EscapeProfileName(const wchar_t *name, ProfileFormat format)
+	{
+		std::string escaped;
+		bool quote = false;
 
-			//Read the data into the buffer
-			for (long i = 0; i < length; i++)
+		for (const wchar_t *c = name; *c != L'\0'; c++)
+		{
+			if (format == PROFILE_JSON)
 			{
-				for (int c = 0; c < format.nChannels; c++)
+				if (*c == L'"' || *c == L'\\')
 				{
-					short sample = 0;
-					std::fread(&sample, sizeof(short), 1, file);
-					*currentSample = (float)sample / (float)MAXSHORT;	//Normalize it to prevent integer overflow later on
-					currentSample++;
+					escaped += '\\';
+					escaped += (char)*c;
 				}
+				else if (*c < 0x20 || *c > 0x7E)
+				{
+					//Every UTF-16 unit on its own, JSON pairs up surrogates the same way
+					char unit[7];
+					snprintf(unit, sizeof(unit), "\\u%04x", (unsigned)*c & 0xFFFF);
+					escaped += unit;
+				}
+				else
+					escaped += (char)*c;
 			}
+			else
+			{
+				if (*c == L'"' || *c == L',' || *c == L'\n' || *c == L'\r')
+					quote = true;
 
-			std::fclose(file);
-			isValid = true;
+				if (*c == L'"')
+					escaped += "\"\"";
+				else
+					escaped += (*c < 0x80) ? (char)*c : '?';
+			}
 		}
 
-	};
+		return quote ? "\"" + escaped + "\"" : escaped;
+	}
 
-	struct CurrentlyPlayingClip
+public:
+	bool SaveProfile(std::wstring fileName, ProfileFormat format = PROFILE_CSV)
 	{
-		int audioClipID = 0;
-
-		long samplePosition = 0;
-
-		bool looped = false;
-		bool paused = false;
-		bool finished = false;
+		FILE *file = nullptr;
+		if (_wfopen_s(&file, fileName.c_str(), L"w") != 0) return false;
 
-		CurrentlyPlayingClip() {}
+		auto writeEntry = [&](const wchar_t* name, const ProfileStats &stats, bool first)
+		{
+			if (format == PROFILE_CSV)
+				fprintf(file, "%s,%d,%.4f,%.4f,%.4f\n", EscapeProfileName(name, format).c_str(), stats.samples, stats.min, stats.avg, stats.p99);
+			else
+				fprintf(file, "%s\n\t\t{ \"name\": \"%s\", \"samples\": %d, \"min_ms\": %.4f, \"avg_ms\": %.4f, \"p99_ms\": %.4f }", first ? "" : ",", EscapeProfileName(name, format).c_str(), stats.samples, stats.min, stats.avg, stats.p99);
+		};
 
-		CurrentlyPlayingClip(int id, bool looped) : audioClipID(id), looped(looped) {}
+		if (format == PROFILE_CSV)
+			fprintf(file, "name,samples,min_ms,avg_ms,p99_ms\n");
+		else
+			fprintf(file, "{\n\t\"entries\": [");
 
-		void Restart()
+		bool first = true;
+		for (int i = 0; i < PHASE_COUNT; i++)
 		{
-			samplePosition = 0;
-			paused = false;
-			finished = false;
+			writeEntry(GetPhaseName(i), phaseHistory[i].GetStats(), first);
+			first = false;
 		}
-	};
 
-	std::vector<AudioClip> audioClips;
-	std::list<CurrentlyPlayingClip> currentlyPlayingClips;
+		for (auto &marker : profileMarkers)
+			writeEntry(marker.name.c_str(), marker.history.GetStats(), false);
 
-	HWAVEOUT device = 0;
+		if (format == PROFILE_JSON)
+			fprintf(file, "\n\t]\n}\n");
 
-	int samplesPerSec = 0;
-	int channels = 0;
-	int blockCount = 0;
-	int samplesPerBlock = 0;
+		fclose(file);
+
+		return true;
+	}
 
-	short *samplesMemory = nullptr;
-	WAVEHDR *blocks = nullptr;
+	////////////////////////////////////////// RECORDING ///////////////////////////////////////////
 
-	int currentBlock = 0;
-	std::atomic<int> freeBlocks = 0;
+private:
+	//Capture files start with a header, followed by one record per presented frame. A record holds the input events
+	//of the frame and the rows that changed since the previous one, each as a span of cells.
+	struct CaptureHeader
+	{
+		char magic[4];
+		WORD version;
+		WORD reserved;
+		int width;
+		int height;
+	};
 
-	std::mutex writingBlock;
-	std::condition_variable blockWritten;
+	struct CaptureFrame
+	{
+		DWORD size;			//Of the whole record in bytes
+		float elapsedTime;	//Seconds since the previous frame
+		float frameTime;	//Milliseconds from the start of the frame until it was submitted
+		WORD eventCount;
+		WORD spanCount;
+	};
 
-	std::atomic<bool> audioThreadActive = false;
-	std::thread audioThread;
+	struct CaptureEvent
+	{
+		WORD type;
+		WORD down;
+		short key;
+		short mouseX;
+		short mouseY;
+		short wheelDelta;
+		short width;
+		short height;
+	};
 
-	std::atomic<float> globalTime = 0.0f;
+	struct CaptureSpan
+	{
+		short y;
+		short left;
+		short count;
+		short reserved;
+	};
 
-	bool soundMuted = false;
-	int currentVolume = MAX_VOLUME;
+	static const WORD captureVersion = 1;
+
+	//The capture is written through a view of the file that is remapped with twice the size whenever it fills up
+	HANDLE captureFile = INVALID_HANDLE_VALUE;
+	BYTE *captureView = nullptr;
+	size_t captureCapacity = 0;
+	size_t captureSize = 0;
+	std::vector<CHAR_INFO> capturedScreen;
+
+	std::chrono::steady_clock::time_point frameStartTime;
+	float frameElapsedTime = 0.0f;
 
-	//Static wrapper for the callback function because Microsoft
-	//(callback cannot be method of the class itself, but it may be called via dwInstance)
-	static void CALLBACK waveOutProcWrapper(HWAVEOUT hwo, UINT uMsg, DWORD dwInstance, DWORD_PTR dwParam1, DWORD_PTR dwParam2)
+	//Events of the current frame that were already written, in case SwapBuffers() is called more than once per frame
+	size_t recordedInputEvents = 0;
+
+	bool MapCapture(size_t capacity)
 	{
-		((ConsoleGameEngine*)dwInstance)->waveOutProc(hwo, uMsg, dwParam1, dwParam2);
+		if (captureView != nullptr)
+			UnmapViewOfFile(captureView);
+		captureView = nullptr;
+
+		//Mapping more than the file holds extends it
+		HANDLE mapping = CreateFileMapping(captureFile, NULL, PAGE_READWRITE, (DWORD)((unsigned long long)capacity >> 32), (DWORD)(capacity & 0xFFFFFFFF), NULL);
+		if (mapping == NULL)
+			return false;
+
+		captureView = (BYTE*)MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, capacity);
+		CloseHandle(mapping);
+
+		captureCapacity = captureView != nullptr ? capacity : 0;
+		return captureView != nullptr;
 	}
 
-	//The actual callback function
-	void waveOutProc(HWAVEOUT hwo, UINT uMsg, DWORD_PTR dwParam1, DWORD_PTR dwParam2)
+	void RecordFrame(const CHAR_INFO *frame)
 	{
-		if (uMsg == WOM_DONE)
+		size_t events = inputEvents.size() - recordedInputEvents;
+		if (events > 0xFFFF)
+			events = 0xFFFF;
+
+		//Worst case is a span for every row
+		size_t required = sizeof(CaptureFrame) + events * sizeof(CaptureEvent) + screenHeight * (sizeof(CaptureSpan) + sizeof(CHAR_INFO) * screenWidth);
+		if (captureSize + required > captureCapacity && !MapCapture(max(captureCapacity * 2, captureSize + required)))
 		{
-			freeBlocks++;
-			std::unique_lock<std::mutex> lock(writingBlock);
-			blockWritten.notify_one();
+			//Without a view there is nowhere to write to, so recording ends with the frames written so far
+			StopRecording();
+			return;
 		}
-	}
 
-	void AudioThread()
-	{
-		float timeStep = 1.0f / (float)samplesPerSec;
+		BYTE *record = captureView + captureSize;
+		BYTE *out = record + sizeof(CaptureFrame);
 
-		auto clip = [](float sample, float maxSample)
+		for (size_t i = 0; i < events; i++)
 		{
-			if (sample >= 0)
-				return min(sample, maxSample);
-			else
-				return max(sample, -maxSample);
-		};
+			const InputEvent &event = inputEvents[recordedInputEvents + i];
+			CaptureEvent captured = { (WORD)event.type, (WORD)event.down, event.key, event.mouseX, event.mouseY, event.wheelDelta, event.width, event.height };
+			memcpy(out, &captured, sizeof(CaptureEvent));
+			out += sizeof(CaptureEvent);
+		}
+		recordedInputEvents = inputEvents.size();
 
-		while (audioThreadActive)
+		WORD spans = 0;
+		for (int y = 0; y < screenHeight; y++)
 		{
-			//Wait for the soundcard to request a block of audio samples
-			if (freeBlocks == 0)
-			{
-				std::unique_lock<std::mutex> lock(writingBlock);
-				while (freeBlocks == 0)
-					blockWritten.wait(lock);
-			}
+			const CHAR_INFO *row = frame + screenWidth * y;
+			CHAR_INFO *capturedRow = capturedScreen.data() + screenWidth * y;
 
-			//Use the block
-			freeBlocks--;
+			if (memcmp(row, capturedRow, sizeof(CHAR_INFO) * screenWidth) == 0)
+				continue;
 
-			//Unprepare block if it has already been used
-			if (blocks[currentBlock].dwFlags & WHDR_PREPARED)
-				waveOutUnprepareHeader(device, &blocks[currentBlock], sizeof(WAVEHDR));
+			int left = 0;
+			while (IsSameCell(row[left], capturedRow[left]))
+				left++;
 
-			int sampleOffset = currentBlock * samplesPerBlock;
+			int right = screenWidth - 1;
+			while (IsSameCell(row[right], capturedRow[right]))
+				right--;
 
-			for (int i = 0; i < samplesPerBlock; i += channels)
-			{
-				for (int c = 0; c < channels; c++)
-				{
-					samplesMemory[sampleOffset + i + c] = (short)(clip(GetMixerOutput(timeStep, c), 1.0f) * (float)MAXSHORT);
-				}
+			CaptureSpan span = { (short)y, (short)left, (short)(right - left + 1), 0 };
+			memcpy(out, &span, sizeof(CaptureSpan));
+			out += sizeof(CaptureSpan);
 
-				globalTime = globalTime + timeStep;
-			}
+			memcpy(out, row + left, sizeof(CHAR_INFO) * span.count);
+			memcpy(capturedRow + left, row + left, sizeof(CHAR_INFO) * span.count);
+			out += sizeof(CHAR_INFO) * span.count;
+			spans++;
+		}
 
-			waveOutPrepareHeader(device, &blocks[currentBlock], sizeof(WAVEHDR));
-			waveOutWrite(device, &blocks[currentBlock], sizeof(WAVEHDR));
+		CaptureFrame header;
+		header.size = (DWORD)(out - record);
+		header.elapsedTime = frameElapsedTime;
+		header.frameTime = ToMilliseconds(std::chrono::steady_clock::now() - frameStartTime);
+		header.eventCount = (WORD)events;
+		header.spanCount = spans;
+		memcpy(record, &header, sizeof(CaptureFrame));
 
-			currentBlock++;
-			currentBlock %= blockCount;
-		}
+		captureSize += header.size;
 	}
 
-	float GetMixerOutput(float timeStep, int channel)
+public:
+	//Reads the frames of a capture file back, one at a time, from a read-only view of the file
+	class CapturePlayer
 	{
-		float mixedSample = 0.0f;
-
-		for (auto &clip : currentlyPlayingClips)
-		{
-			if (clip.paused)
-				continue;
+	private:
+		const BYTE *view = nullptr;
+		size_t size = 0;
+		size_t offset = 0;
 
-			clip.samplePosition += (long)((float)audioClips[clip.audioClipID].format.nSamplesPerSec * timeStep);
+		int width = 0;
+		int height = 0;
 
-			if (clip.samplePosition < audioClips[clip.audioClipID].length)
-				mixedSample += audioClips[clip.audioClipID].data[(clip.samplePosition * audioClips[clip.audioClipID].format.nChannels) + channel];
-			else if (clip.looped)
-				clip.Restart();
-			else
-				clip.finished = true;
-		}
+		std::vector<CHAR_INFO> frame;
+		std::vector<InputEvent> events;
+		float elapsedTime = 0.0f;
+		float frameTime = 0.0f;
 
-		currentlyPlayingClips.remove_if([](const CurrentlyPlayingClip &clip) { return clip.finished; });
+	public:
+		CapturePlayer() {}
 
-		mixedSample += onUserSoundSample(channel, globalTime, timeStep);
+		CapturePlayer(const CapturePlayer&) = delete;
+		CapturePlayer& operator=(const CapturePlayer&) = delete;
 
-		return onUserSoundFilter(channel, globalTime, mixedSample);
-	}
+		~CapturePlayer()
+		{
+			Close();
+		}
 
-public:
-	void PlayAudioClip(int id, bool loop = false)
-	{
-		if (id < 0 || id >= (int)audioClips.size()) return;
-		CurrentlyPlayingClip clipToPlay(id, loop);
-		currentlyPlayingClips.push_back(clipToPlay);
-	}
+		bool Open(const std::wstring& fileName)
+		{
+			Close();
 
-protected:
-	unsigned int LoadAudioClip(std::wstring fileName)
-	{
-		AudioClip audioClip(fileName);
+			HANDLE file = CreateFile(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+			if (file == INVALID_HANDLE_VALUE) return false;
 
-		if (!audioClip.isValid)
-			return -1;
+			LARGE_INTEGER fileSize;
+			HANDLE mapping = NULL;
+			if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart >= (LONGLONG)sizeof(CaptureHeader))
+				mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
 
-		audioClips.push_back(audioClip);
-		return audioClips.size() - 1;
-	}
+			CloseHandle(file);
+			if (mapping == NULL) return false;
 
-	bool StartAudio(int samplesPerSec = 44100, int channels = 1, int blockCount = 8, int samplesPerBlock = 512)
-	{
-		if (audioThreadActive)
-			DestroyAudio();
+			view = (const BYTE*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+			CloseHandle(mapping);
+			if (view == nullptr) return false;
 
-		this->samplesPerSec = samplesPerSec;
-		this->channels = channels;
-		this->blockCount = blockCount;
-		this->samplesPerBlock = samplesPerBlock;
+			size = (size_t)fileSize.QuadPart;
 
-		freeBlocks = blockCount;
+			CaptureHeader header;
+			memcpy(&header, view, sizeof(CaptureHeader));
+			if (memcmp(header.magic, "CGEC", 4) != 0 || header.version != captureVersion || header.width <= 0 || header.height <= 0 || header.width > 0x7FFF || header.height > 0x7FFF)
+			{
+				Close();
+				return false;
+			}
 
-		soundMuted = false;
-		currentVolume = MAX_VOLUME;
+			width = header.width;
+			height = header.height;
+			Rewind();
 
-		WAVEFORMATEX format;
-		format.wFormatTag = WAVE_FORMAT_PCM;
-		format.nChannels = channels;
-		format.nSamplesPerSec = samplesPerSec;
-		format.wBitsPerSample = sizeof(short) * 8;
-		format.nBlockAlign = format.nChannels * (format.wBitsPerSample / 8);
-		format.nAvgBytesPerSec = format.nSamplesPerSec * format.nBlockAlign;
-		format.cbSize = 0;
-
-		if (waveOutOpen(&device, WAVE_MAPPER, &format, (DWORD_PTR)waveOutProcWrapper, (DWORD_PTR)this, CALLBACK_FUNCTION) != S_OK)
-			return false;
+			return true;
+		}
 
-		samplesMemory = new short[blockCount * samplesPerBlock];
-		if (samplesMemory == nullptr)
-			return false;
-		SecureZeroMemory(samplesMemory, sizeof(short) * blockCount * samplesPerBlock);
+		void Close()
+		{
+			if (view != nullptr)
+				UnmapViewOfFile(view);
 
-		blocks = new WAVEHDR[blockCount];
-		if (blocks == nullptr)
-			return false;
-		SecureZeroMemory(blocks, sizeof(WAVEHDR) * blockCount);
+			view = nullptr;
+			size = 0;
+			offset = 0;
+		}
 
-		//Make each block point to a particular position in the buffer of samples
-		for (int i = 0; i < blockCount; i++)
+		//Goes back to before the first frame, with every cell zeroed
+		void Rewind()
 		{
-			blocks[i].lpData = (LPSTR)(samplesMemory + (i * samplesPerBlock));
-			blocks[i].dwBufferLength = sizeof(short) * samplesPerBlock;
+			offset = sizeof(CaptureHeader);
+			frame.assign((size_t)width * height, CHAR_INFO());
+			events.clear();
 		}
 
-		audioThreadActive = true;
-		audioThread = std::thread(&ConsoleGameEngine::AudioThread, this);
+		//Applies the next record to the frame. Returns false at the end of the capture, or if the record is malformed.
+		bool NextFrame()
+		{
+			if (view == nullptr || size - offset < sizeof(CaptureFrame))
+				return false;
 
-		std::unique_lock<std::mutex> lock(writingBlock);
-		blockWritten.notify_one();
+			CaptureFrame header;
+			memcpy(&header, view + offset, sizeof(CaptureFrame));
+			if (header.size < sizeof(CaptureFrame) || header.size > size - offset)
+				return false;
 
-		return true;
-	}
+			const BYTE *in = view + offset + sizeof(CaptureFrame);
+			const BYTE *end = view + offset + header.size;
 
-	void DestroyAudio()
-	{
-		audioThreadActive = false;
+			if ((size_t)(end - in) < header.eventCount * sizeof(CaptureEvent))
+				return false;
 
-		if (audioThread.joinable())
-			audioThread.join();
+			events.resize(header.eventCount);
+			for (InputEvent &event : events)
+			{
+				CaptureEvent captured;
+				memcpy(&captured, in, sizeof(CaptureEvent));
+				in += sizeof(CaptureEvent);
+
+				event = InputEvent();
+				event.type = (InputEventType)captured.type;
+				event.down = captured.down != 0;
+				event.key = captured.key;
+				event.mouseX = captured.mouseX;
+				event.mouseY = captured.mouseY;
+				event.wheelDelta = captured.wheelDelta;
+				event.width = captured.width;
+				event.height = captured.height;
+			}
 
-		waveOutSetVolume(device, MAX_VOLUME);
-		soundMuted = false;
+			for (int i = 0; i < header.spanCount; i++)
+			{
+				CaptureSpan span;
+				if ((size_t)(end - in) < sizeof(CaptureSpan))
+					return false;
 
-		waveOutReset(device);
-		waveOutClose(device);
+				memcpy(&span, in, sizeof(CaptureSpan));
+				in += sizeof(CaptureSpan);
 
-		samplesPerSec = 0;
-		channels = 0;
-		blockCount = 0;
-		samplesPerBlock = 0;
+				if (span.y < 0 || span.y >= height || span.left < 0 || span.count < 0 || span.left + span.count > width || (size_t)(end - in) < sizeof(CHAR_INFO) * span.count)
+					return false;
 
-		globalTime = 0.0f;
+				memcpy(frame.data() + width * span.y + span.left, in, sizeof(CHAR_INFO) * span.count);
+				in += sizeof(CHAR_INFO) * span.count;
+			}
 
-		if (samplesMemory != nullptr) delete[] samplesMemory;
+			elapsedTime = header.elapsedTime;
+			frameTime = header.frameTime;
+			offset += header.size;
 
-		if (blocks != nullptr)
+			return true;
+		}
+
+		bool IsOpen() const
 		{
-			for (int i = 0; i < blockCount; i++)
-				waveOutUnprepareHeader(device, &blocks[i], sizeof(WAVEHDR));
+			return view != nullptr;
+		}
 
-			delete[] blocks;
+		int GetWidth() const
+		{
+			return width;
 		}
-	}
 
-	virtual float onUserSoundSample(int channel, float globalTime, float timeStep)
-	{
-		return 0.0f;
-	}
+		int GetHeight() const
+		{
+			return height;
+		}
 
-	virtual float onUserSoundFilter(int channel, float globalTime, float mixedSample)
-	{
-		return mixedSample;
-	}
+		const CHAR_INFO* GetFrame() const
+		{
+			return frame.data();
+		}
 
-	int GetVolume()
-	{
-		return currentVolume;
-	}
+		//Input events that were read during the frame
+		const std::vector<InputEvent>& GetInputEvents() const
+		{
+			return events;
+		}
 
-	void SetVolume(float percent)
-	{
-		if (percent < 0)
-			percent = 0;
-		else if (percent > 100)
-			percent = 100;
+		float GetElapsedTime() const
+		{
+			return elapsedTime;
+		}
 
-		int oneChannelVolume = (int)(percent * 2.55f);
-		currentVolume = oneChannelVolume * oneChannelVolume;
-		if (!soundMuted)
-			waveOutSetVolume(device, currentVolume);
-	}
+		float GetFrameTime() const
+		{
+			return frameTime;
+		}
+	};
 
-	void MuteAudio()
+protected:
+	//Appends every presented frame to the file, as the rows that changed since the previous frame, together with
+	//the input events and timings of the frame. Any recording in progress is stopped first.
+	bool StartRecording(const std::wstring& fileName)
 	{
-		soundMuted = true;
-		waveOutSetVolume(device, 0x0000);
-	}
+		StopRecording();
 
-	void UnmuteAudio()
-	{
-		soundMuted = false;
-		waveOutSetVolume(device, currentVolume);
-	}
+		captureFile = CreateFile(fileName.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (captureFile == INVALID_HANDLE_VALUE)
+			return false;
 
-	void PauseAudio(int id)
-	{
-		for (auto &clip : currentlyPlayingClips)
+		//Room for the header and a few dozen full frames to begin with
+		if (!MapCapture(sizeof(CaptureHeader) + 64 * (size_t)screenWidth * screenHeight * sizeof(CHAR_INFO)))
 		{
-			if (clip.audioClipID == id)
-				clip.paused = !clip.paused;
+			CloseHandle(captureFile);
+			captureFile = INVALID_HANDLE_VALUE;
+			return false;
 		}
-	}
 
-	void PauseAllAudio()
-	{
-		for (auto &clip : currentlyPlayingClips)
-		{
-			clip.paused = !clip.paused;
-		}
+		CaptureHeader header = { { 'C', 'G', 'E', 'C' }, captureVersion, 0, screenWidth, screenHeight };
+		memcpy(captureView, &header, sizeof(CaptureHeader));
+		captureSize = sizeof(CaptureHeader);
+
+		//The first frame is stored against an all-zero screen, the same as the player starts out with
+		capturedScreen.assign((size_t)screenWidth * screenHeight, CHAR_INFO());
+		recordedInputEvents = inputEvents.size();
+
+		return true;
 	}
 
-	void RestartAudio(int id)
+	//Cuts the file down to the recorded frames and closes it
+	void StopRecording()
 	{
-		for (auto &clip : currentlyPlayingClips)
-		{
-			if (clip.audioClipID == id)
-				clip.Restart();
-		}
+		if (captureFile == INVALID_HANDLE_VALUE)
+			return;
+
+		if (captureView != nullptr)
+			UnmapViewOfFile(captureView);
+		captureView = nullptr;
+		captureCapacity = 0;
+
+		LARGE_INTEGER end;
+		end.QuadPart = (LONGLONG)captureSize;
+		if (SetFilePointerEx(captureFile, end, NULL, FILE_BEGIN))
+			SetEndOfFile(captureFile);
+
+		CloseHandle(captureFile);
+		captureFile = INVALID_HANDLE_VALUE;
+		capturedScreen.clear();
+		capturedScreen.shrink_to_fit();
 	}
 
-	void RestartAllAudio()
+	bool IsRecording()
 	{
-		for (auto &clip : currentlyPlayingClips)
-		{
-			clip.Restart();
-		}
+		return captureView != nullptr;
 	}
 
-	void StopAudio(int id)
+	//Presents every frame of the capture as fast as possible, e.g. to measure presentation on a recorded workload.
+	//The capture has to match the size of the screen. The time spent presenting goes into the present phase of the profiler.
+	//Fails while recording, since the played frames would be recorded into the other capture.
+	bool PlayCapture(const std::wstring& fileName, int &frames)
 	{
-		for (auto &clip : currentlyPlayingClips)
+		frames = 0;
+
+		if (IsRecording())
+			return false;
+
+		CapturePlayer player;
+		if (!player.Open(fileName) || player.GetWidth() != screenWidth || player.GetHeight() != screenHeight)
+			return false;
+
+		while (player.NextFrame())
 		{
-			if (clip.audioClipID == id)
-				clip.finished = true;
+			auto mark = std::chrono::steady_clock::now();
+			frameStartTime = mark;
+			frameElapsedTime = player.GetElapsedTime();
+
+			SubmitFrame(player.GetFrame());
+			MarkPhase(PHASE_PRESENT, mark);
+			EndProfiledFrame(player.GetElapsedTime());
+
+			frames++;
 		}
-	}
 
-	void StopAllAudio()
-	{
-		currentlyPlayingClips.clear();
-		waveOutReset(device);
+		return true;
 	}
 
 };
 
-std::atomic<bool> ConsoleGameEngine::running = false;
-std::condition_variable ConsoleGameEngine::finished;
-std::mutex ConsoleGameEngine::gameMutex;
\ No newline at end of file
+std::vector<ConsoleGameEngine*> ConsoleGameEngine::instances;
+std::mutex ConsoleGameEngine::instancesMutex;
+bool ConsoleGameEngine::closeHandlerInstalled = false;
\ No newline at end of file